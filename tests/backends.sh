@@ -0,0 +1,132 @@
+#!/bin/sh
+# Runs every tape backend on the same machines and inputs, and compares
+# their answers with the ones of paged tapes.
+# Usage: tests/backends.sh [TM_SIM]
+
+sim=${1:-./tm-sim}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+# Forks on every blank, each branch writing its own cells
+cat > "$dir/forks.txt" <<'END'
+tr
+0 _ _ R 0
+0 _ a L 0
+acc
+max
+20
+run
+
+END
+
+# 2^17 branches with tapes of their own: more than the mappings a process
+# can have, which flat tapes must not run out of
+cat > "$dir/wide.txt" <<'END'
+tr
+0 _ a R 0
+0 _ b R 0
+0 a a S 1
+acc
+1
+max
+17
+run
+
+END
+
+# Nondeterministic search for "aa", marking the cells it guesses
+cat > "$dir/guess.txt" <<'END'
+tr
+0 a a R 0
+0 b b R 0
+0 a x R 1
+1 a y L 2
+2 x x S 3
+acc
+3
+max
+100
+run
+ab
+aab
+bbbaabb
+b
+
+END
+
+# Deterministic: swaps the symbols, then walks back to the first cell
+cat > "$dir/swap.txt" <<'END'
+tr
+0 a b R 0
+0 b a R 0
+0 _ _ L 1
+1 a a L 1
+1 b b L 1
+1 _ _ R 2
+acc
+2
+max
+1000
+run
+abba
+a
+
+END
+awk 'BEGIN { for (i = 0; i < 3000; i++) printf "ab"; print "" }' \
+  >> "$dir/swap.txt"
+
+# Only moves right
+cat > "$dir/right.txt" <<'END'
+tr
+0 a a R 0
+0 b b R 0
+0 a a R 1
+1 b b R 2
+2 _ _ R 3
+acc
+3
+max
+50
+run
+aab
+ab
+ba
+abab
+
+END
+
+# Binary counter writing far from its input, and forking on each carry
+cat > "$dir/count.txt" <<'END'
+tr
+0 0 0 R 0
+0 1 1 R 0
+0 _ _ L 1
+1 1 0 L 1
+1 0 1 R 0
+1 _ 1 R 0
+1 0 1 S 4
+4 1 1 S 5
+acc
+5
+max
+2000
+run
+0
+101
+111
+0000
+END
+
+for m in "$dir"/*.txt; do
+  "$sim" --tape paged < "$m" > "$dir/expected" 2> /dev/null
+  for tape in auto packed rle flat mapped; do
+    if ! "$sim" --tape $tape < "$m" > "$dir/got" 2> /dev/null ||
+       ! cmp -s "$dir/expected" "$dir/got"; then
+      echo "FAIL: $(basename "$m") with $tape tapes"
+      fail=1
+    fi
+  done
+done
+[ $fail -eq 0 ] && echo "All the backends agree with paged tapes"
+exit $fail
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Runs a machine that never accepts and would branch far past any budget,
+# and checks that --budget and --deadline stop it with U, probed or not.
+# Usage: tests/limits.sh [TM_SIM]
+
+sim=${1:-./tm-sim}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+# 2^40 branches writing a or b, none of which accepts
+cat > "$dir/wide.txt" <<'END'
+tr
+0 _ a R 0
+0 _ b R 0
+0 a a S 1
+acc
+1
+max
+40
+run
+
+END
+
+for limit in "--budget 1000" "--deadline 200"; do
+  for probe in "" "--probe 4 --probe-threads 1"; do
+    got=$(timeout 10 "$sim" $limit $probe < "$dir/wide.txt" 2> /dev/null)
+    if [ "$got" != "U" ]; then
+      echo "FAIL: $limit $probe answered '$got' instead of U"
+      fail=1
+    fi
+  done
+done
+[ $fail -eq 0 ] && echo "The limits stop the runs, probed or not"
+exit $fail
@@ -4,15 +4,57 @@
   * (c) 2018 Alessandro Fulgini. All rights reserved
   */
 
+#define _POSIX_C_SOURCE 200809L /* For clock_gettime, fmemopen, sysconf */
+#define _DEFAULT_SOURCE /* For MAP_ANONYMOUS and MAP_NORESERVE */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
 
 #define STR_LEN 4
 #define PAGE_SIZE 64
+#define STORE_INITIAL_BUCKETS 1024
+#define TRIM_PERIOD 1024 /* Steps between two trims of a branch's tape */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LIMIT_PERIOD 4096 /* Steps between two checks of the clock */
+#define CHUNK_LINES 64 /* Initial lines per chunk sent to a worker */
+#define CHUNK_TARGET_MS 500 /* Wanted duration of a chunk on a worker */
+#define NET_MAX_MESSAGE (1L << 30) /* Longest message taken from a peer */
+#define EXPLORE_KEEP 1024 /* Branches a worker keeps, it ships the others */
+#define BRANCH_HEADER 48 /* Bytes of a serialized branch before its cells */
+#define AUTOTUNE_SAMPLE 32 /* Input lines the candidates are timed on */
+#define AUTOTUNE_STEPS 200000 /* Steps per candidate over the sample */
+#define AUTOTUNE_MS 50 /* Minimum timing per candidate, the sample is rerun */
+#define ANALYZE_LIST 20 /* Entries of each list in the text report */
+#define ANALYZE_STEPS 64 /* Steps the branching growth is estimated over */
+#define HIST_SUB_BITS 4 /* Buckets per power of two are 2^4: 6% precision */
+#define HIST_BUCKETS (64 << HIST_SUB_BITS) /* Enough for any 64-bit value */
+#define SUMMARY_SLOWEST 10 /* Default slowest inputs listed by --summary */
+#define PROBE_SEED 1 /* Default seed of the random walks */
+#define FLAT_MAX_STEPS (1L << 32) /* Above, flat tapes reserve too much */
+#define FLAT_MAX_TAPES 8192 /* 3 mappings each, far below vm.max_map_count */
+#define LOOP_MAX_CELLS 64 /* Largest region checked for loops, plus one */
+#define NFA_MAX_TABLE (64L << 20) /* Bytes of the tables of the NFA engine */
 #define INITIAL_STATE 0
 #define BLANK '_'
+#define BLANK_ID 0 /* Dense ID of BLANK, so that blank pages are all zeros */
 #define SYM_ACCEPT '1'
 #define SYM_REFUSE '0'
 #define SYM_UNDET 'U'
@@ -22,26 +64,14 @@
   #define LOG_STATUS(tm, b) {\
     if(b->tr != NULL) {\
       printf("STATUS: %d, %c -> %d, %c, %c\n",\
-        (int) (b->state - tm->states), head_read(b),\
-        b->tr->state, b->tr->output, b->tr->move);\
+        (int) (b->state - tm->states), tm->alpha.sym[(unsigned char) head_read(b)],\
+        b->tr->state, tm->alpha.sym[(unsigned char) b->tr->output], b->tr->move);\
     }\
   }
   #define LOG_TAPE(b) {\
     if(b->tr != NULL) {\
       printf("TAPE: ");\
-      page_t * p = b->tape->first_page;\
-      int i = 0;\
-      while (p != NULL) {\
-        printf("%c", p->mem[i]);\
-        if (p == b->head_page && i == b->head_pos) {\
-          printf("!");\
-        }\
-        i++;\
-        if (i == PAGE_SIZE) {\
-          i = 0;\
-          p = p->next;\
-        }\
-      }\
+      b->tape->ops->print(b);\
       printf("\n");\
     }\
   }
@@ -51,33 +81,132 @@
   #define LOG_TAPE(b)
 #endif
 
+#ifdef STATS
+  #define STAT(stmt) stmt
+  #define STAT_PEAK(peak, value) {\
+    if ((value) > (peak)) {\
+      (peak) = (value);\
+    }\
+  }
+#else
+  #define STAT(stmt)
+  #define STAT_PEAK(peak, value)
+#endif
+
 /**
   * TYPE DEFINITIONS
   */
 
 typedef struct page page_t;
+typedef struct page_store page_store_t;
 typedef struct tape tape_t;
+typedef struct tape_ops tape_ops_t;
+typedef struct run run_t;
+typedef struct alphabet alphabet_t;
 typedef struct branch branch_t;
 typedef struct tr_output tr_output_t;
 typedef struct tr_input tr_input_t;
+typedef struct tr_sig tr_sig_t;
 typedef struct state state_t;
 typedef struct turing_machine tm_t;
+typedef struct job job_t;
+typedef struct machine_entry machine_entry_t;
+typedef struct batch batch_t;
+typedef struct range range_t;
+typedef struct cluster cluster_t;
+typedef struct node node_t;
+typedef struct explore explore_t;
+typedef struct peer peer_t;
+typedef struct histogram histogram_t;
+typedef struct summary summary_t;
+typedef struct slow_input slow_input_t;
+typedef struct probe probe_t;
+typedef struct nfa nfa_t;
+
+/** Structure for the dense symbol IDs: tapes and transitions hold IDs,
+  * symbols which behave the same way in every state share one.
+  */
+struct alphabet {
+  int size; /* Number of IDs */
+  int used; /* Symbols of the loaded transitions, before merging */
+  int bits; /* Bits per cell of packed tapes: 1, 2 or 4, 0 if too many IDs */
+  int cell_shift; /* log2 of the cells per byte */
+  int cpp; /* Cells per page of packed tapes */
+  unsigned char code[UCHAR_MAX + 1]; /* Symbol -> ID, BLANK is BLANK_ID */
+  char sym[UCHAR_MAX + 1]; /* ID -> symbol, for debug prints */
+};
 
 /* Structure for general turing machine information */
 struct turing_machine {
+  FILE * in; /* Machine description and input strings */
+  FILE * out; /* Answers */
   int max_state; /* Highest state number */
   long int max_steps; /* Maximum steps per-branch */
   branch_t * rq_head; /* Head of runqueue */
   branch_t * rq_tail; /* Tail of runqueue */
+  long int rq_len; /* Number of branches in the runqueue */
+  long int compress_above; /* Runqueue length above which tapes are packed,
+                              0 to never pack */
+  long int deadline_ms; /* Wall-clock time per input, 0 for none */
+  long int step_budget; /* Steps per input over all branches, 0 for none */
+  long int inputs; /* Number of inputs run so far */
+  bool quiet; /* Don't report the limits reached on stderr */
+  summary_t * summary; /* Costs of the inputs, NULL if not recorded */
+  long int progress_ms; /* Interval of the progress reports, 0 for none */
+  long int progress_due; /* Elapsed ms of the next periodic report */
+  sig_atomic_t progress_seen; /* Report requests already answered */
+  long int report_work; /* Steps at the previous report of this input */
+  long int report_ms; /* Elapsed ms at the previous report of this input */
+  long int probe_walks; /* Random walks tried before the exact run, 0 for none */
+  int probe_threads; /* Threads running the walks, 0 for one per CPU */
+  uint64_t probe_seed; /* Seed of the walks, the same one repeats them */
+  probe_t * probe; /* Threads of the walks, started by the first input */
+  long int work; /* Steps done on the current input */
+  long int next_check; /* Value of work at which limits are checked */
+  struct timespec started; /* When the current input started */
+  const char * limit; /* Limit which stopped the current input, if any */
+  long int mem_cap; /* Bytes held per input, 0 for no cap */
+  long int mem_limit; /* Bytes held at which memory is reduced, then capped */
+  long int mem_base; /* Bytes held before the current input */
+  bool degraded; /* Over the memory cap once: depth-first, packed tapes */
+  const tape_ops_t * tape_ops; /* Backend of the tapes, NULL to pick one */
+  explore_t * explore; /* Share of a distributed tree, NULL if run alone */
+  alphabet_t alpha; /* Dense symbol IDs */
+  char * line; /* Buffer for the input string */
+  long int line_cap;
+  char * map; /* The input file mapped for mapped tapes, NULL if not */
+  size_t map_len;
+  long int map_base; /* Offset of the mapping in the file */
+  long int map_pos; /* Offset of the next line in the mapping */
+  tr_sig_t * sigs; /* Transitions being loaded */
+  long int sigs_count;
+  long int sigs_cap;
+  long int tr_loaded; /* Transitions as loaded, before merging symbols */
+  int tr_words; /* Words of each state's bitmap in tr_masks */
+  uint64_t * tr_masks; /* Per state, bitmap of the IDs with transitions */
+  tr_input_t * tr_inputs; /* All the states' inputs, sorted by state and ID */
+  tr_output_t * tr_outputs; /* All the transitions */
+  long int tr_count; /* Transitions in tr_outputs */
+  bool malformed; /* A section or the max steps were missing */
+  bool deterministic; /* At most one transition per state and symbol */
+  bool state_sets; /* Nondeterministic with at most 64 states: branches
+                      hold sets of states, see tm_compute_sets */
+  int set_groups; /* Most groups a set of states can fork into at once */
+  bool detect_loops; /* Drop the branches surely looping in a region */
+  int loop_cells; /* Regions of fewer cells are checked, 0 for none */
+  long int * loop_bounds; /* Per region size n, configurations in it */
+  nfa_t * nfa; /* Automaton of a machine only moving right, NULL if not */
+  int states_cap; /* Allocated states */
   state_t * states; /* [0...max_state] vector */
 };
 
 /* Structure for state information */
 struct state {
   bool is_acc;
+  long int acc_dist; /* Minimum transitions to acceptance, LONG_MAX if never */
   int tr_inputs_count;
   tr_input_t * tr_inputs; /* [0...tr_inputs_count] vector of
-                              <input,tr_output> entries */
+                              <input,tr_output> entries, sorted by input */
 };
 
 /* Structure for trainsition input->output linking */
@@ -87,6 +216,16 @@ struct tr_input {
                                 <state,output,move> */
 };
 
+/* Structure for a whole transition, as loaded before being indexed */
+struct tr_sig {
+  unsigned char input; /* Input symbol, then its ID */
+  unsigned char output; /* Output symbol, then its ID */
+  unsigned char out_class; /* Class of the output while merging symbols */
+  char move;
+  int state;
+  int next; /* Next state */
+};
+
 /* Structure for transition's output (right part) */
 struct tr_output {
   int state; /* Next state */
@@ -95,113 +234,882 @@ struct tr_output {
   tr_output_t * next; /* Link to next transition */
 };
 
+/* Structure for a job of a batch manifest */
+struct job {
+  char * machine; /* Path of the machine description */
+  char * input; /* Path of the input strings */
+  char * output; /* Path of the answers */
+};
+
+/* Structure for a machine loaded once for all the jobs using it */
+struct machine_entry {
+  uint64_t hash; /* Hash of the description */
+  long int size;
+  char * text; /* The description, to tell collisions apart */
+  bool loaded; /* Whether tm is ready, it is being loaded otherwise */
+  tm_t * tm;
+  machine_entry_t * next;
+};
+
+/* Structure for a batch of jobs, shared by the workers */
+struct batch {
+  tm_t * options; /* Machine holding the command line options */
+  job_t * jobs;
+  int job_count;
+  int next_job; /* First job not yet taken by a worker */
+  machine_entry_t * machines; /* Cache of the loaded machines */
+  int machines_loaded;
+  int machines_reused;
+  long int inputs; /* Input strings run */
+  int failed; /* Jobs which could not be run */
+  pthread_mutex_t lock;
+  pthread_cond_t loaded; /* Signaled when a machine has been loaded */
+};
+
+/* Structure for a range of input lines */
+struct range {
+  long int first;
+  long int count;
+};
+
+/* Structure for the input lines sharded by a coordinator */
+struct cluster {
+  char * machine; /* Description sent to every worker */
+  long int machine_len;
+  char ** lines; /* Input lines, each ending at a newline or at lines_end */
+  char * lines_end;
+  long int line_count;
+  char * answers; /* Answer of each line, 0 while not known */
+  long int next_line; /* First line not yet handed out */
+  range_t * retry; /* Ranges given back by failed workers */
+  int retry_count;
+  int retry_cap;
+  int in_flight; /* Ranges being run by workers */
+  pthread_mutex_t lock;
+  pthread_cond_t changed; /* Signaled when ranges are done or given back */
+};
+
+/* Structure for a worker process seen from the coordinator */
+struct node {
+  cluster_t * cluster;
+  char * host;
+  char * port;
+  long int chunks; /* Chunks answered */
+  long int lines; /* Lines answered */
+  bool failed;
+  pthread_t thread;
+};
+
+/* Structure for a worker's share of a computation tree explored by many */
+struct explore {
+  int fd; /* Connection to the coordinator */
+  int rank; /* This worker, owning the branches which hash to it */
+  int size; /* Number of workers */
+  long int received; /* Batches of branches received */
+  bool stopped; /* The coordinator has stopped the input */
+};
+
+/* Structure for a worker exploring a tree, seen from the coordinator */
+struct peer {
+  char * host;
+  char * port;
+  int fd; /* -1 once failed */
+  int rank;
+  char * out; /* Messages not yet sent, the socket may be full */
+  long int out_len;
+  long int out_sent;
+  long int out_cap;
+  long int sent; /* Batches forwarded to the worker during the input */
+  long int received; /* Batches the worker said it received when idle */
+  long int batches; /* Batches forwarded over all the inputs */
+  bool idle; /* The worker has run out of branches */
+  bool preempted; /* The worker has preempted some branch */
+  bool done; /* The worker has acknowledged the end of the input */
+};
+
+/** Histogram of positive values in logarithmic buckets, as HDR histograms:
+  * values below 2^HIST_SUB_BITS are exact, the others fall in one of the
+  * 2^HIST_SUB_BITS buckets splitting their power of two.
+  */
+struct histogram {
+  long int counts[HIST_BUCKETS];
+  long int total; /* Values added */
+  uint64_t max;
+};
+
+/* Structure for an input among the slowest ones */
+struct slow_input {
+  long int input; /* Index, as in the messages on stderr */
+  uint64_t ns;
+  long int steps;
+  char answer;
+};
+
+/* Structure for the costs of the inputs, printed by --summary */
+struct summary {
+  histogram_t ns; /* Wall-clock time of each input */
+  histogram_t steps; /* Steps of each input, over all its branches */
+  long int answers[3]; /* Refused, accepted, undetermined */
+  struct timespec started; /* When the first input was read */
+  int slowest_cap; /* Slowest inputs kept */
+  int slowest_count;
+  slow_input_t * slowest; /* Sorted, slowest first */
+};
+
+/** Structure for the random walks probing the inputs of a machine.
+  * Its threads are started once, and wait for each input to walk it.
+  */
+struct probe {
+  tm_t * tm; /* Machine, holding the input in tm->line */
+  long int len; /* Cells of the input */
+  uint64_t seed; /* Seed of the input, each walk derives its own */
+  long int next_walk; /* First walk not yet taken by a thread */
+  long int steps; /* Steps of the walks, charged to the input */
+  bool accepted; /* Some walk has accepted, the others stop */
+  const char * limit; /* Limit which stopped the walks, if any */
+  long int input; /* Input being walked, the threads wait for the next */
+  int running; /* Threads still walking the input */
+  bool quit; /* The threads end */
+  int thread_count; /* The caller walks too */
+  pthread_t * threads;
+  pthread_mutex_t lock;
+  pthread_cond_t start; /* Signaled when an input is ready, or to quit */
+  pthread_cond_t done; /* Signaled when the last thread is done with it */
+};
+
+/** Structure for a machine which only moves right, run as an automaton:
+  * all its branches are on the same cell, so a set of states is enough.
+  */
+struct nfa {
+  int words; /* Words of a set of states */
+  int groups; /* Bytes of a set, each one indexing its own table */
+  uint64_t * table; /* Per ID, byte of the set and value: successors */
+  uint64_t * live; /* Per ID, the states with transitions on it */
+  uint64_t * final; /* The accepting states without transitions */
+};
+
 /* Structure for computation branches */
 struct branch {
   state_t * state; /* Current state */
   tr_output_t * tr; /* Transition to be executed by tm_step */
-  page_t * head_page; /* TM Head page */
-  int head_pos; /* Position on current page (0...PAGE_SIZE-1)*/
+  union { /* TM Head, its meaning depends on the tape backend */
+    struct { /* Paged tapes */
+      page_t * head_page; /* Head page, NULL if the cell is not materialized */
+      int head_pos; /* Position on current page (0...PAGE_SIZE-1)*/
+      long int head_pnum; /* Absolute number of the head page */
+    };
+    char * head_ptr; /* Flat tapes: the cell under the head */
+    struct { /* Run-length tapes */
+      long int head_cell; /* Absolute position */
+      int head_run; /* Run under the head, -1 or run_count if outside */
+      long int head_off; /* Position in the run */
+    };
+  };
   long int steps; /* Number of transitions from the root of the tree */
+  long int cell; /* Head position, tracked only to detect loops */
+  long int lo; /* Region of the cells the head has been on, or written */
+  long int hi;
+  long int loop_at; /* Steps at which it is surely looping, LONG_MAX if never */
+  uint64_t states; /* With state sets, the states of the configuration */
   tape_t * tape; /* The tape, which may be shared with other branches */
 
   branch_t * next; /* Next branch in the runqueue */
 };
 
-/* Structure for memory page */
+/** Structure for memory page.
+  * Once interned in the page store a page is immutable, and it may be
+  * referenced by any number of tapes.
+  */
 struct page {
-  page_t *prev, *next; /* Linked list */
+  int ref_count; /* Number of tape slots referencing this page */
+  bool interned; /* The page is in the store, so it must not be modified */
+  unsigned int hash; /* Content hash, valid while interned */
+  page_t * bucket_next; /* Next page in the store bucket */
   char mem[PAGE_SIZE]; /* Actual memory of PAGE_SIZE */
 };
 
-/* Structure for the memory tape */
+/* Structure for the content-addressed page store (one per process) */
+struct page_store {
+  unsigned int mask; /* Number of buckets - 1, it is a power of two */
+  unsigned int count; /* Number of interned pages */
+  page_t ** buckets; /* Hash chains of interned pages */
+  page_t * blank; /* The interned all-blank page, never freed */
+  page_t * input; /* Marks the slots of mapped tapes still on their input,
+                     never freed: it is interned, but not in the buckets */
+};
+
+/* Structure for a run of equal cells */
+struct run {
+  long int len;
+  char sym;
+};
+
+/** Structure for the memory tape.
+  * Only a region of the tape is materialized, every cell outside of it is
+  * a virtual blank. Its layout depends on the backend:
+  *  - paged tapes are a sequence of page handles (the default);
+  *  - run-length tapes are a sequence of runs of equal cells;
+  *  - mapped tapes are paged tapes over an input mapped from its file.
+  */
 struct tape {
   int ref_count; /* Number of branches sharing this tape */
-  page_t * first_page;
+  bool settled; /* Its branches are never shipped to another worker */
+  const tape_ops_t * ops; /* Backend */
+  const alphabet_t * alpha; /* Symbols of the IDs in the cells */
+  char * packed; /* Compressed content while queued, if any */
+  int packed_len;
+  union {
+    struct { /* Paged tapes */
+      long int first_pnum; /* Absolute number of pages[0] */
+      int page_count; /* pages[0...page_count-1] */
+      int room_left; /* Free slots allocated before pages[0] */
+      int room_right; /* Free slots allocated after the last page */
+      page_t ** pages; /* NULL slots are stored in packed while queued */
+      const char * source; /* Mapped tapes: the input, as symbols */
+      long int source_len;
+    };
+    struct { /* Flat tapes */
+      char * map; /* Reserved range, with a guard page at both ends */
+      size_t map_len;
+      char * cells; /* Cell 0, the head never leaves the range from here */
+      long int lo; /* Written cells are in [lo, hi], none if lo > hi */
+      long int hi;
+    };
+    struct { /* Run-length tapes */
+      long int first_cell; /* Absolute position of the first run */
+      long int cell_count; /* Cells covered by the runs */
+      int run_count; /* runs[0...run_count-1] */
+      int run_cap;
+      run_t * runs; /* Adjacent runs never have the same symbol */
+    };
+  };
+};
+
+/** Structure for a tape backend, the engine only uses tapes through it.
+  * The optional operations may be NULL.
+  */
+struct tape_ops {
+  const char * name;
+  char (*read)(branch_t * b);
+  void (*write)(branch_t * b, char c);
+  void (*move)(branch_t * b, char move);
+  void (*seek)(branch_t * b, long int cell); /* Put the head on a cell */
+  void (*share)(branch_t * b); /* Optional, before a private tape is shared */
+  void (*destroy)(tape_t * t);
+  void (*trim)(branch_t * b, long int reach); /* Optional */
+  void (*pack)(branch_t * b); /* Optional, with unpack */
+  void (*unpack)(branch_t * b);
+  void (*print)(branch_t * b); /* Debug print */
 };
 
+/* Page store, one per thread */
+_Thread_local page_store_t store;
+
+/* Bytes held by branches, tapes and pages of the thread */
+_Thread_local long int mem_held = 0;
+
+/* Counters of the thread, for the progress reports */
+_Thread_local struct {
+  long int branches_created;
+  long int branches_destroyed;
+  long int pages; /* Live pages */
+  long int cow_bytes; /* Bytes copied to make tapes and pages private */
+} counters;
+
+/* Flat tapes mapped by all the threads, see flat_map */
+long int flat_tapes = 0;
+
+/* Progress reports asked with SIGUSR1, each running input answers them */
+volatile sig_atomic_t progress_requests = 0;
+
+#ifdef STATS
+/* Counters for the page store, printed at exit */
+_Thread_local struct {
+  long int pages; /* Live page structures */
+  long int page_refs; /* Live tape slots */
+  long int peak_pages;
+  long int peak_page_refs;
+  long int interns; /* Pages looked up in the store */
+  long int intern_hits; /* Lookups that found an identical page */
+  long int packs; /* Tapes packed in the runqueue */
+  long int packed_in; /* Bytes of pages packed */
+  long int packed_out; /* Bytes after packing */
+} stats;
+#endif
+
 /* FUNCTION PROTOTYPES */
 inline tm_t tm_create();
 inline void tm_destroy(tm_t * tm);
 
-inline void state_insert_transition(
-  state_t * state,
-  char input,
-  int q_out,
-  char output,
-  char move
-);
+inline page_t * page_create(char * mem);
+inline void page_release(page_t * p);
+inline page_t * page_intern(page_t * p);
+inline unsigned int page_hash(char * mem);
 
-inline page_t * page_create(page_t * prev, page_t * next, char * mem);
+inline void store_init();
+inline void store_destroy();
+inline void store_insert(page_t * p);
+inline void store_remove(page_t * p);
 
+inline branch_t * branch_create(tm_t * tm, const char * cells, long int first,
+  long int count);
 inline branch_t * branch_clone(branch_t * parent, tr_output_t * tr);
+inline void branch_track(tm_t * tm, branch_t * b, char move);
+inline void branch_regrow(tm_t * tm, branch_t * b);
+inline void tm_loop_bounds(tm_t * tm);
+
+inline nfa_t * nfa_create(tm_t * tm);
+inline void nfa_destroy(nfa_t * a);
+inline char nfa_run(tm_t * tm, long int len);
+inline long int nfa_run_word(nfa_t * a, const char * cells, long int count,
+  uint64_t * set, long int * work);
+inline void nfa_step(nfa_t * a, const uint64_t * from, int id, uint64_t * to);
+inline bool branch_can_accept(tm_t * tm, branch_t * b);
+inline tape_t * tape_create(const tape_ops_t * ops);
+inline char tape_read(branch_t * b);
+inline void tape_write(branch_t * b, char c);
+inline void tape_move(branch_t * b, char move);
+inline void tape_seek(branch_t * b, long int cell);
+inline void tape_print(branch_t * b);
+inline void tape_destroy(tape_t * t);
+inline void tape_seal(branch_t * b);
 inline void tape_make_private(branch_t * branch);
+inline void tape_materialize(branch_t * b);
+inline void tape_reserve(tape_t * t, int left, int right);
+inline void tape_trim(branch_t * b, long int reach);
+inline long int cell_page(long int cell, long int cpp);
+inline void tape_pack(branch_t * b);
+inline void tape_unpack(branch_t * b);
+inline page_t * tape_page_at(tape_t * t, long int pnum);
+
+inline char packed_read(branch_t * b);
+inline void packed_write(branch_t * b, char c);
+inline void packed_move(branch_t * b, char move);
+inline void packed_seek(branch_t * b, long int cell);
+inline void packed_print(branch_t * b);
+inline int packed_get(const alphabet_t * a, page_t * p, int pos);
+
+inline char rle_read(branch_t * b);
+inline void rle_write(branch_t * b, char c);
+inline void rle_move(branch_t * b, char move);
+inline void rle_seek(branch_t * b, long int cell);
+inline void rle_print(branch_t * b);
+inline void rle_destroy(tape_t * t);
+inline void rle_make_private(branch_t * b);
+inline void rle_extend(branch_t * b);
+inline void rle_insert(tape_t * t, int i, int n);
+inline void rle_remove(tape_t * t, int i);
+
+inline char flat_read(branch_t * b);
+inline void flat_write(branch_t * b, char c);
+inline void flat_move(branch_t * b, char move);
+inline void flat_seek(branch_t * b, long int cell);
+inline void flat_print(branch_t * b);
+inline void flat_destroy(tape_t * t);
+inline bool flat_reserve(tape_t * t, long int max_steps);
+inline bool flat_map(tape_t * t, size_t len, size_t offset);
+inline void flat_make_private(branch_t * b);
+inline void flat_copy_paged(branch_t * b, tape_t * parent);
+inline void flat_extend(tape_t * t, long int cell);
+
+inline char mapped_read(branch_t * b);
+inline void mapped_write(branch_t * b, char c);
+inline void mapped_print(branch_t * b);
+inline void mapped_make_private(branch_t * b);
+inline void mapped_attach(tm_t * tm, branch_t * b, const char * source,
+  long int len);
+inline bool input_map(tm_t * tm);
+inline const char * input_line(tm_t * tm, long int * len);
+inline void input_unmap(tm_t * tm);
+
+inline int lz_bound(int n);
+inline int lz_compress(char * src, int n, char * dst);
+inline int lz_decompress(char * src, int n, char * dst);
+inline void head_page_make_private(branch_t * b);
 inline void branch_destroy(branch_t * branch);
 
 inline char head_read(branch_t * b);
 inline void head_write (branch_t * b, char c);
 inline void head_move(branch_t * b, char c);
 
+inline int batch_run(tm_t * options, const char * manifest, int workers);
+inline void * batch_worker(void * arg);
+inline bool batch_job(batch_t * batch, job_t * job);
+inline tm_t * batch_machine(batch_t * batch, const char * path);
+inline char * file_read(const char * path, long int * size);
+inline uint64_t text_hash(const char * text, long int size);
+
+inline tm_t tm_load_text(const tm_t * options, char * text, long int size);
+inline char * tm_answer_text(tm_t * tm, char * text, long int size,
+  long int * len);
+
+inline int cluster_coordinate(tm_t * options, char * workers);
+inline void * cluster_node(void * arg);
+inline bool cluster_take(cluster_t * c, range_t * r);
+inline void cluster_done(cluster_t * c, range_t * r, const char * answers);
+inline void cluster_give_back(cluster_t * c, range_t * r);
+inline char * cluster_chunk(cluster_t * c, range_t * r, long int * len);
+inline int cluster_serve(tm_t * options, const char * host,
+  const char * port);
+inline void cluster_serve_conn(tm_t * options, int fd);
+inline int net_connect(const char * host, const char * port);
+inline bool net_send(int fd, char type, const char * data, long int len);
+inline char * net_recv(int fd, char * type, long int * len);
+inline char * stream_read(FILE * f, long int * size);
+inline char * text_split(char * text, char * end, char ** lines);
+inline void put_u64(char * dst, uint64_t v);
+inline uint64_t get_u64(const char * src);
+
+tm_t * tmsim_load(const char * text, long int size, const char * tape,
+  long int deadline_ms, long int step_budget, long int mem_cap_mb);
+long int tmsim_run(const tm_t * machine, const char * inputs, long int size,
+  char * answers);
+void tmsim_free(tm_t * machine);
+
+inline int explore_coordinate(tm_t * options, char * workers);
+inline char explore_input(peer_t * peers, int peer_count, char * line,
+  long int len);
+inline void explore_stop(peer_t * peers, int peer_count);
+inline void peer_queue(peer_t * p, char type, const char * data, long int len);
+inline bool peer_flush(peer_t * p);
+inline void peer_fail(peer_t * p);
+inline void explore_serve(tm_t * tm, int fd, char * data, long int len);
+inline bool explore_idle(tm_t * tm, bool preempted);
+inline bool explore_sync(tm_t * tm);
+inline bool explore_recv(tm_t * tm, bool wait);
+inline void explore_ship(tm_t * tm);
+inline long int branch_save(branch_t * b, tm_t * tm, char ** buf,
+  long int * len, long int * cap);
+inline branch_t * branch_load(tm_t * tm, const char * rec, long int * len);
+
 inline void rq_enqueue(tm_t * tm, branch_t * b);
 inline branch_t * rq_dequeue(tm_t * tm);
 
+inline void tm_load(tm_t * tm);
+inline void tm_run_inputs(tm_t * tm);
 inline void load_transitions(tm_t * tm);
 inline void load_acc(tm_t * tm);
+inline void tm_compute_acc_dist(tm_t * tm);
+inline bool tm_compress_alphabet(tm_t * tm);
+inline int tr_sig_cmp(const void * a, const void * b);
+inline int tr_sig_cmp_tail(const tr_sig_t * x, const tr_sig_t * y);
+inline int tr_sig_state_cmp(const void * a, const void * b);
+inline bool tr_sig_same(tr_sig_t * x, long int xn, tr_sig_t * y, long int yn);
+inline void tm_index_transitions(tm_t * tm);
+
+inline char * tm_autotune(tm_t * tm, const char * cache, long int * len);
+inline uint64_t tm_hash(tm_t * tm);
+inline double tm_time_sample(tm_t * tm, const tape_ops_t * ops, char * sample,
+  long int len, long int lines);
+inline const tape_ops_t * tune_cache_find(const char * cache, uint64_t hash);
+
+inline void tm_analyze(tm_t * tm, bool json);
+inline double tm_growth(tm_t * tm);
+inline void report_list(FILE * f, bool json, const char * key, int * items,
+  int count);
+inline void json_char(FILE * f, char sym);
+
+inline summary_t * summary_create(int slowest);
+inline void summary_destroy(summary_t * sum);
+inline void summary_record(summary_t * sum, long int input, uint64_t ns,
+  long int steps, char answer);
+inline void summary_print(summary_t * sum, FILE * f);
+inline void histogram_add(histogram_t * h, uint64_t v);
+inline int histogram_bucket(uint64_t v);
+inline uint64_t histogram_highest(int bucket);
+inline uint64_t histogram_percentile(histogram_t * h, double p);
+inline const char * format_ns(char * buf, uint64_t ns);
+
+inline char tm_probe(tm_t * tm, long int len);
+inline probe_t * probe_create(int thread_count);
+inline void probe_destroy(probe_t * p);
+inline void * probe_worker(void * arg);
+inline void probe_run(probe_t * p);
+inline bool probe_walk(probe_t * p, uint64_t rng);
+inline bool probe_charge(probe_t * p, long int steps);
+inline uint64_t rng_next(uint64_t * rng);
+inline uint64_t rng_mix(uint64_t x);
 
 inline char tm_run(tm_t * tm);
+inline void tm_begin(tm_t * tm);
 inline char tm_compute_rq(tm_t * tm);
+inline char tm_compute_alone(tm_t * tm, branch_t * b);
+inline char tm_compute_with(tm_t * tm, branch_t * b, const tape_ops_t * ops)
+  __attribute__((always_inline));
+inline char tm_compute_sets(tm_t * tm);
+inline bool tm_step_set(tm_t * tm, branch_t * b);
+inline bool branch_sets_can_accept(tm_t * tm, branch_t * b);
+inline bool tm_forks_merge(const tm_t * tm);
+inline int tm_set_groups(const tm_t * tm);
+inline bool tm_check_limits(tm_t * tm, long int depth);
+inline void tm_progress(tm_t * tm, long int depth, long int elapsed_ms);
+inline void progress_signal(int sig);
+inline bool tm_reduce_memory(tm_t * tm);
 inline state_t * tm_step(tm_t * tm, branch_t * b);
 
-inline tr_input_t * search_tr_input(tr_input_t * v, int p, int r, char key);
+inline tr_input_t * tm_find_tr_input(tm_t * tm, state_t * s, char input);
+
+/* TAPE BACKENDS */
+const tape_ops_t paged_tape = {
+  "paged", tape_read, tape_write, tape_move, tape_seek, tape_seal,
+  tape_destroy, tape_trim, tape_pack, tape_unpack, tape_print
+};
+const tape_ops_t packed_tape = {
+  "packed", packed_read, packed_write, packed_move, packed_seek, tape_seal,
+  tape_destroy, tape_trim, tape_pack, tape_unpack, packed_print
+};
+const tape_ops_t rle_tape = {
+  "rle", rle_read, rle_write, rle_move, rle_seek, NULL,
+  rle_destroy, NULL, NULL, NULL, rle_print
+};
+const tape_ops_t flat_tape = {
+  "flat", flat_read, flat_write, flat_move, flat_seek, NULL,
+  flat_destroy, NULL, NULL, NULL, flat_print
+};
+const tape_ops_t mapped_tape = {
+  "mapped", mapped_read, mapped_write, tape_move, tape_seek, tape_seal,
+  tape_destroy, tape_trim, tape_pack, tape_unpack, mapped_print
+};
+const tape_ops_t * tape_backends[] = {
+  &paged_tape, &packed_tape, &rle_tape, &flat_tape, &mapped_tape, NULL
+};
 
 /**
   * MAIN
   */
-int main() {
-  int reads;
-  char res;
+#ifndef LIBRARY /* Built as libtmsim.so, see the SHARED LIBRARY section */
+int main(int argc, char * argv[]) {
+  char s[STR_LEN];
+  const char * manifest = NULL, * serve = NULL, * listen_host = "127.0.0.1";
+  char * coordinate = NULL, * explore = NULL, * sample, * answers;
+  char tune_cache[PATH_MAX] = "";
+  bool autotune = false, analyze = false, json = false, summary = false;
+  long int sample_len, answers_len;
+  int workers = 0, slowest = SUMMARY_SLOWEST, reads, res;
+  struct sigaction sa;
   /* LOAD MACHINE CONFIGURATION */
 
   /* 1. Create turing machine instance */
+  store_init();
   tm_t tm = tm_create();
+  for (int i = 1; i < argc; i++) { /* Parse options */
+    if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc) {
+      tm.compress_above = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--deadline") == 0 && i + 1 < argc) {
+      tm.deadline_ms = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+      tm.step_budget = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--mem-cap") == 0 && i + 1 < argc) {
+      tm.mem_cap = atol(argv[++i]) * 1024 * 1024;
+    } else if (strcmp(argv[i], "--manifest") == 0 && i + 1 < argc) {
+      manifest = argv[++i];
+    } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      workers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+      serve = argv[++i];
+    } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+      listen_host = argv[++i];
+    } else if (strcmp(argv[i], "--coordinate") == 0 && i + 1 < argc) {
+      coordinate = argv[++i];
+    } else if (strcmp(argv[i], "--explore") == 0 && i + 1 < argc) {
+      explore = argv[++i];
+    } else if (strcmp(argv[i], "--summary") == 0) {
+      summary = true;
+      if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+        slowest = atoi(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "--probe") == 0 && i + 1 < argc) {
+      tm.probe_walks = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--probe-threads") == 0 && i + 1 < argc) {
+      tm.probe_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--probe-seed") == 0 && i + 1 < argc) {
+      tm.probe_seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--detect-loops") == 0) {
+      tm.detect_loops = true;
+    } else if (strcmp(argv[i], "--progress") == 0 && i + 1 < argc) {
+      tm.progress_ms = (long int) (atof(argv[++i]) * 1000);
+    } else if (strcmp(argv[i], "--autotune") == 0) {
+      autotune = true;
+    } else if (strcmp(argv[i], "--analyze") == 0) {
+      analyze = true;
+      if (i + 1 < argc && (strcmp(argv[i + 1], "text") == 0 ||
+                           strcmp(argv[i + 1], "json") == 0)) {
+        json = strcmp(argv[++i], "json") == 0;
+      }
+    } else if (strcmp(argv[i], "--autotune-cache") == 0 && i + 1 < argc) {
+      snprintf(tune_cache, sizeof(tune_cache), "%s", argv[++i]);
+    } else if (strcmp(argv[i], "--tape") == 0 && i + 1 < argc) {
+      i++;
+      tm.tape_ops = NULL;
+      for (int j = 0; tape_backends[j] != NULL; j++) {
+        if (strcmp(argv[i], tape_backends[j]->name) == 0) {
+          tm.tape_ops = tape_backends[j];
+        }
+      }
+      if (tm.tape_ops == NULL && strcmp(argv[i], "auto") != 0) {
+        fprintf(stderr, "Unknown tape backend: %s\n", argv[i]);
+        tm_destroy(&tm);
+        store_destroy();
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Usage: %s [--compress FRONTIER] "
+        "[--tape auto|paged|packed|rle|flat|mapped] [--deadline MS] "
+        "[--budget STEPS] [--mem-cap MB] [--manifest FILE [--jobs N]] "
+        "[--worker PORT [--listen ADDRESS]] "
+        "[--coordinate HOST:PORT,...] [--explore HOST:PORT,...] "
+        "[--autotune [--autotune-cache FILE]] [--analyze [text|json]] "
+        "[--progress SECONDS] [--summary [N]] "
+        "[--probe WALKS [--probe-threads N] [--probe-seed S]] "
+        "[--detect-loops]\n",
+        argv[0]);
+      tm_destroy(&tm);
+      store_destroy();
+      return 1;
+    }
+  }
 
-  /* 2. Load transitions */
-  char s[STR_LEN];
-  reads = scanf("%s", s); /* Read the "tr" string */
-  getchar(); /* Flush endline */
-  load_transitions(&tm);
-
-  /* 3. Load acceptance states */
-  reads = scanf("%s", s); /* Read the "acc" string */
-  getchar(); /* Flush endline */
-  load_acc(&tm);
-
-  /* 4. Load max steps */
-  reads = scanf("%s", s); /* Read the "max" string */
-  getchar(); /* Flush endline */
-  reads = scanf("%ld", &tm.max_steps); /* Read max steps number */
-  if (reads) getchar(); /* Flush endline */
-
-  /* 5. Simulate on input */
-  reads = scanf("%s", s); /* Read the "run" string */
-  getchar(); /* Flush endline */
-  while ((res = getchar()) != EOF) {
-    ungetc(res, stdin);
-    res = tm_run(&tm); /* RUN SIMULATION */
-    printf("%c\n", res);
-  }
-
-  /* 6. Clear memory */
+  if (tm.probe_threads <= 0) {
+    tm.probe_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  /* kill -USR1 prints a progress report, whatever the mode */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = progress_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  if (manifest != NULL) { /* Batch mode, the options apply to every job */
+    if (workers <= 0) {
+      workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    res = batch_run(&tm, manifest, workers > 0 ? workers : 1);
+    tm_destroy(&tm);
+    store_destroy();
+    return res;
+  }
+  if (serve != NULL || coordinate != NULL || explore != NULL) { /* Multi-node */
+    res = serve != NULL ? cluster_serve(&tm, listen_host, serve) :
+          coordinate != NULL ? cluster_coordinate(&tm, coordinate) :
+                               explore_coordinate(&tm, explore);
+    tm_destroy(&tm);
+    store_destroy();
+    return res;
+  }
+
+  /* 2. Load transitions, acceptance states and max steps */
+  tm_load(&tm);
+  if (analyze) { /* Report on the machine instead of running it */
+    tm_analyze(&tm, json);
+    tm_destroy(&tm);
+    store_destroy();
+    return 0;
+  }
+
+  /* 3. Simulate on input */
+  reads = fscanf(tm.in, "%3s", s); /* Read the "run" string */
+  if (reads > 0) {
+    getc(tm.in); /* Flush endline */
+    if (autotune) { /* Pick the tape backend, then answer its sample */
+      if (tune_cache[0] == '\0' && getenv("HOME") != NULL) {
+        snprintf(tune_cache, sizeof(tune_cache), "%s/.tm-sim-autotune",
+          getenv("HOME"));
+      }
+      sample = tm_autotune(&tm, tune_cache, &sample_len);
+      if (summary) { /* The timings of the candidates don't count */
+        tm.summary = summary_create(slowest);
+      }
+      if (sample_len > 0) {
+        answers = tm_answer_text(&tm, sample, sample_len, &answers_len);
+        fwrite(answers, 1, answers_len, tm.out);
+        free(answers);
+      }
+      free(sample);
+    }
+    if (summary && tm.summary == NULL) {
+      tm.summary = summary_create(slowest);
+    }
+    tm_run_inputs(&tm);
+    if (tm.summary != NULL) {
+      summary_print(tm.summary, stderr);
+      summary_destroy(tm.summary);
+    }
+  }
+
+  /* 4. Clear memory */
   tm_destroy(&tm);
+  store_destroy();
+  STAT(fprintf(stderr, "STATS: pages %ld, page refs %ld (peak), "
+    "dedup ratio %.2f, store hits %ld/%ld\n",
+    stats.peak_pages, stats.peak_page_refs,
+    stats.peak_pages ? (double) stats.peak_page_refs / stats.peak_pages : 1.0,
+    stats.intern_hits, stats.interns));
+  STAT(fprintf(stderr, "STATS: tapes packed %ld, %ld -> %ld bytes\n",
+    stats.packs, stats.packed_in, stats.packed_out));
   return 0;
 }
+#endif
+
+/** Loads the machine from tm->in: the "tr", "acc" and "max" sections.
+  * Also picks the tape backend, if left to choose. Missing sections are
+  * recorded in tm->malformed, for the shared library to refuse them.
+  */
+void tm_load(tm_t * tm) {
+  char s[STR_LEN];
+  int reads;
+
+  /* 1. Load transitions */
+  reads = fscanf(tm->in, "%3s", s); /* Read the "tr" string */
+  getc(tm->in); /* Flush endline */
+  tm->malformed = reads <= 0 || strcmp(s, "tr") != 0;
+  load_transitions(tm);
+  if (tm_compress_alphabet(tm)) { /* Few IDs, cells can be packed */
+    if (tm->tape_ops == NULL) {
+      tm->tape_ops = &packed_tape;
+    }
+  } else if (tm->tape_ops == NULL || tm->tape_ops == &packed_tape) {
+    tm->tape_ops = &paged_tape;
+  }
+  LOG("INFO: %d symbol IDs, %s tapes\n", tm->alpha.size, tm->tape_ops->name);
+  tm_index_transitions(tm);
+
+  /* 2. Load acceptance states */
+  reads = fscanf(tm->in, "%3s", s); /* Read the "acc" string */
+  getc(tm->in); /* Flush endline */
+  tm->malformed |= reads <= 0 || strcmp(s, "acc") != 0;
+  load_acc(tm);
+  tm_compute_acc_dist(tm);
+
+  /* 3. Load max steps */
+  reads = fscanf(tm->in, "%3s", s); /* Read the "max" string */
+  getc(tm->in); /* Flush endline */
+  tm->malformed |= reads <= 0 || strcmp(s, "max") != 0;
+  reads = fscanf(tm->in, "%ld", &tm->max_steps); /* Read max steps number */
+  if (reads > 0) getc(tm->in); /* Flush endline */
+  tm->malformed |= reads <= 0;
+  if (tm->tape_ops == &flat_tape && tm->max_steps > FLAT_MAX_STEPS) {
+    fprintf(stderr, "Too many steps for flat tapes, using paged tapes\n");
+    tm->tape_ops = &paged_tape;
+  }
+  if (tm->detect_loops) {
+    tm_loop_bounds(tm);
+  }
+  tm->nfa = nfa_create(tm); /* If it only moves right */
+  tm->state_sets = !tm->deterministic && tm->max_state < 64 &&
+                   tm_forks_merge(tm);
+  if (tm->state_sets) {
+    tm->set_groups = tm_set_groups(tm);
+  }
+}
+
+/** Loads a machine from its description in memory,
+  * with the command line options of another one.
+  */
+tm_t tm_load_text(const tm_t * options, char * text, long int size) {
+  tm_t tm = tm_create();
+  tm.compress_above = options->compress_above;
+  tm.deadline_ms = options->deadline_ms;
+  tm.step_budget = options->step_budget;
+  tm.mem_cap = options->mem_cap;
+  tm.progress_ms = options->progress_ms;
+  tm.detect_loops = options->detect_loops;
+  tm.probe_walks = options->probe_walks;
+  tm.probe_threads = options->probe_threads;
+  tm.probe_seed = options->probe_seed;
+  tm.tape_ops = options->tape_ops;
+  tm.in = fmemopen(text, size, "r");
+  tm_load(&tm);
+  fclose(tm.in);
+  tm.in = stdin;
+  return tm;
+}
+
+/** Runs the machine on each line of a text in memory.
+  * Returns the answers, one per line as printed, and their length.
+  */
+char * tm_answer_text(tm_t * tm, char * text, long int size, long int * len) {
+  char * answers = NULL;
+  size_t answers_len = 0;
+  FILE * in = tm->in, * out = tm->out;
+
+  tm->in = fmemopen(text, size, "r");
+  tm->out = open_memstream(&answers, &answers_len);
+  tm_run_inputs(tm);
+  fclose(tm->in);
+  fclose(tm->out);
+  tm->in = in;
+  tm->out = out;
+  *len = (long int) answers_len;
+  return answers;
+}
+
+/* Runs the machine on each line of tm->in, writing the answers to tm->out */
+void tm_run_inputs(tm_t * tm) {
+  int c;
+  if (tm->tape_ops == &mapped_tape && tm->explore == NULL) {
+    input_map(tm); /* The lines are then walked through the mapping */
+  }
+  while (tm->map != NULL ? tm->map_pos < (long int) tm->map_len :
+                           (c = getc(tm->in)) != EOF) {
+    if (tm->map == NULL) {
+      ungetc(c, tm->in);
+    }
+    c = tm_run(tm); /* RUN SIMULATION */
+    fprintf(tm->out, "%c\n", c);
+  }
+  input_unmap(tm);
+}
 
 /* Creates an initialised turing machine instance */
 tm_t tm_create() {
   tm_t tm;
+  tm.in = stdin;
+  tm.out = stdout;
   tm.max_state = 0;
   tm.max_steps = 0;
   tm.rq_head = NULL;
   tm.rq_tail = NULL;
+  tm.rq_len = 0;
+  tm.compress_above = 0;
+  tm.deadline_ms = 0;
+  tm.step_budget = 0;
+  tm.mem_cap = 0;
+  tm.inputs = 0;
+  tm.quiet = false;
+  tm.summary = NULL;
+  tm.progress_ms = 0;
+  tm.progress_seen = 0;
+  tm.probe_walks = 0;
+  tm.probe_threads = 0;
+  tm.probe_seed = PROBE_SEED;
+  tm.probe = NULL;
+  tm.tape_ops = &paged_tape;
+  tm.explore = NULL;
+  tm.line = NULL;
+  tm.line_cap = 0;
+  tm.map = NULL;
+  tm.map_len = 0;
+  tm.map_base = 0;
+  tm.map_pos = 0;
+  tm.sigs = NULL;
+  tm.sigs_count = 0;
+  tm.tr_loaded = 0;
+  tm.sigs_cap = 0;
+  tm.tr_words = 0;
+  tm.tr_masks = NULL;
+  tm.tr_inputs = NULL;
+  tm.tr_outputs = NULL;
+  tm.tr_count = 0;
+  tm.malformed = false;
+  tm.deterministic = false;
+  tm.state_sets = false;
+  tm.set_groups = 0;
+  tm.detect_loops = false;
+  tm.loop_cells = 0;
+  tm.loop_bounds = NULL;
+  tm.nfa = NULL;
+  tm.states_cap = 1;
   tm.states = (state_t *) malloc(sizeof(state_t)); /* Initial state */
   tm.states[0].tr_inputs_count = 0;
   tm.states[0].tr_inputs = NULL;
@@ -211,56 +1119,51 @@ tm_t tm_create() {
 
 /* Destroys a turing machine and deallocates memory */
 void tm_destroy(tm_t * tm) {
-  state_t * s;
-  tr_output_t *tr, *tr_next;
-  /* Delete each state */
-  for (int i = 0; i <= tm->max_state; i++) {
-    s = &tm->states[i];
-
-    /* Delete the output transition list for each input */
-    for (int j = 0; j < s->tr_inputs_count; j++) {
-      tr = s->tr_inputs[j].transitions;
-      while (tr != NULL) {
-        tr_next = tr->next;
-        free(tr);
-        tr = tr_next;
-      }
-    }
-
-    /* Delete the input list itself */
-    free(s->tr_inputs);
-  }
+  /* Delete the transitions, all in the index arrays */
+  free(tm->sigs);
+  free(tm->tr_masks);
+  free(tm->tr_inputs);
+  free(tm->tr_outputs);
+  free(tm->loop_bounds);
+  nfa_destroy(tm->nfa);
+  probe_destroy(tm->probe);
 
   /* Delete the states list */
   free(tm->states);
+  free(tm->line);
   return;
 }
 
-/** Loads the transitions from stdin:
+/** Loads the transitions from tm->in:
   *  - states are stored in array, indexed with the state number;
-  *    it gets expanded when new states are found.
-  *  - each state holds an array of tr_input structs, each representing
-  *    an input char with associated transition(s); ita also gets expanded
-  *  - each tr_input holds a list of (at least one) output transition(s)
+  *    it gets doubled when new states are found.
+  *  - transitions are appended to the tm->sigs array, and indexed
+  *    all at once by tm_index_transitions when the symbols have their IDs.
   *  The expected transition format is:
   *  "(state) (input) (output) (move) (next state)"
   */
 void load_transitions(tm_t* tm) {
   state_t * s;
+  tr_sig_t * sig;
   char input, output, move;
   int q_in, q_out, reads, max;
   do { /* Loading stops when the "acc" keyword is found */
     /* Scan the whole string */
-    reads = scanf("%d %c %c %c %d", &q_in, &input, &output, &move, &q_out);
-    if(reads) { /* reads = 0 means that the "tr" section is finished */
-      getchar(); /* Flush newline */
+    reads = fscanf(tm->in, "%d %c %c %c %d",
+      &q_in, &input, &output, &move, &q_out);
+    if (reads > 0) { /* reads = 0 means that the "tr" section is finished */
+      getc(tm->in); /* Flush newline */
 
       /* First extend the states array if necessary */
       max = q_in > q_out ? q_in : q_out;
       if (max > tm->max_state) { /* Extend the size */
-        LOG("DEBUG: New status array limit: %d\n", max);
-        tm->states = (state_t *)
-                            realloc(tm->states, (max + 1) * sizeof(state_t));
+        if (max >= tm->states_cap) {
+          tm->states_cap = max >= 2 * tm->states_cap ? max + 1 :
+                                                       2 * tm->states_cap;
+          LOG("DEBUG: New status array limit: %d\n", tm->states_cap - 1);
+          tm->states = (state_t *)
+                      realloc(tm->states, tm->states_cap * sizeof(state_t));
+        }
         while (tm->max_state < max) { /* Initialise new states */
           s = &tm->states[tm->max_state + 1];
           s->tr_inputs_count = 0;
@@ -270,253 +1173,1153 @@ void load_transitions(tm_t* tm) {
         }
       }
 
-      /* Insert the new transition */
-      state_insert_transition(&tm->states[q_in], input, q_out, output, move);
-
+      /* Append the new transition */
+      if (tm->sigs_count == tm->sigs_cap) {
+        tm->sigs_cap = tm->sigs_cap > 0 ? tm->sigs_cap * 2 : 1024;
+        tm->sigs = (tr_sig_t *)
+                    realloc(tm->sigs, tm->sigs_cap * sizeof(tr_sig_t));
+      }
+      sig = &tm->sigs[tm->sigs_count++];
+      sig->input = (unsigned char) input;
+      sig->output = (unsigned char) output;
+      sig->move = move;
+      sig->state = q_in;
+      sig->next = q_out;
     }
-  } while(reads != 0);
+  } while (reads > 0);
+  tm->tr_loaded = tm->sigs_count;
 
   LOG("INFO: Max state: %d\n", tm->max_state);
 }
 
-/* Adds transition to an existing state during input parsing */
-void state_insert_transition(
-  state_t * s,
-  char input,
-  int q_out,
-  char output,
-  char move
-) {
-  tr_output_t * tr_out = NULL;
-  tr_input_t * tr_in = NULL;
-
-  /* First create the transition */
-  tr_out = (tr_output_t *) malloc(sizeof(tr_output_t));
-  tr_out->state = q_out;
-  tr_out->output = output;
-  tr_out->move = move;
-
-  if (s->tr_inputs_count == 0) {
-    /* Insert the first element */
-    s->tr_inputs = (tr_input_t *) malloc(sizeof(tr_input_t));
-    s->tr_inputs_count++;
-    tr_in = s->tr_inputs;
-
-    /* Then set up the new entry */
-    tr_in->input = input;
-    tr_in->transitions = NULL;
-  } else {
-    /* Look if the input transition already exists */
-    tr_in = search_tr_input(s->tr_inputs, 0, s->tr_inputs_count-1, input);
-
-    /* If it does not exist, extend the array by one */
-    if (tr_in == NULL) {
-      s->tr_inputs_count++;
-      s->tr_inputs = (tr_input_t *)
-                realloc(s->tr_inputs, s->tr_inputs_count * sizeof(tr_input_t));
-      /* Insert the new element at the end */
-      tr_in = &s->tr_inputs[s->tr_inputs_count - 1]; /* Begin from the last entry */
-
-      /* Then set up the new entry */
-      tr_in->input = input;
-      tr_in->transitions = NULL;
-    }
-  }
-
-  /* Insert the new transition at the head of the list */
-  tr_out->next = tr_in->transitions;
-  tr_in->transitions = tr_out;
-}
-
 /* Loads acceptance states */
 void load_acc(tm_t * tm) {
   int q, reads;
   LOG("INFO: Acceptance states: ");
   do {
-    reads = scanf("%d", &q);
-    if (reads) {
-      getchar(); /* Flush endline */
+    reads = fscanf(tm->in, "%d", &q);
+    if (reads > 0) {
+      getc(tm->in); /* Flush endline */
       LOG("%d, ", q);
       if (q <= tm->max_state) {
         tm->states[q].is_acc = true;
       } /* If the state is not in the list it would be unreachable */
     }
-  } while(reads != 0);
+  } while (reads > 0);
   LOG("\n");
   return;
 }
 
-/* Creates and initialises a memory page */
-page_t * page_create(page_t * prev, page_t * next, char * mem) {
-  LOG("DEBUG: Creating new page: %p\t%p\n", prev, next);
-  page_t * p = (page_t *) malloc(sizeof(page_t));
-  p->prev = prev;
-  p->next = next;
+/** Computes the distance of each state from acceptance, that is the
+  * minimum number of transitions needed to halt in an acceptance state,
+  * with a backwards breadth-first visit of the transition graph.
+  */
+void tm_compute_acc_dist(tm_t * tm) {
+  int n = tm->max_state + 1;
+  int *in_first, *in_states, *queue;
+  int q, head = 0, tail = 0;
+  state_t * s;
+  tr_output_t * tr;
 
-  if (mem == NULL) { /* If no memory to copy is given, intialize blank one */
-    for (int i = 0; i < PAGE_SIZE; i++) {
-      p->mem[i] = BLANK;
+  /* Build the reversed graph, as an array of predecessors per state */
+  in_first = (int *) calloc(n + 1, sizeof(int));
+  for (q = 0; q < n; q++) {
+    s = &tm->states[q];
+    for (int j = 0; j < s->tr_inputs_count; j++) {
+      for (tr = s->tr_inputs[j].transitions; tr != NULL; tr = tr->next) {
+        in_first[tr->state + 1]++;
+      }
     }
-  } else { /* Copy the memory, char by char */
-    for (int i = 0; i < PAGE_SIZE; i++) {
-      p->mem[i] = mem[i];
+  }
+  for (q = 0; q < n; q++) {
+    in_first[q + 1] += in_first[q];
+  }
+  in_states = (int *) malloc((in_first[n] + 1) * sizeof(int));
+  queue = (int *) malloc(n * sizeof(int));
+  for (q = 0; q < n; q++) {
+    s = &tm->states[q];
+    for (int j = 0; j < s->tr_inputs_count; j++) {
+      for (tr = s->tr_inputs[j].transitions; tr != NULL; tr = tr->next) {
+        in_states[in_first[tr->state]++] = q;
+      }
     }
   }
-  return p;
-}
-
-/* Creates a new branch from its parent, the memory is shared */
-branch_t * branch_clone(branch_t * parent, tr_output_t * tr) {
-  branch_t * b;
-
-  /* Allocate structure */
-  b = (branch_t *) malloc(sizeof(branch_t));
-
-  /* Copy static variables */
-  b->state = parent->state;
-  b->head_pos = parent->head_pos;
-  b->steps = parent->steps;
-  b->tr = tr;
+  for (q = n; q > 0; q--) { /* Shift the starts back in place */
+    in_first[q] = in_first[q - 1];
+  }
+  in_first[0] = 0;
 
-  /* Share memory with parent */
-  b->tape = parent->tape;
-  b->tape->ref_count++;
-  b->head_page = parent->head_page;
+  /* Visit from the states where the machine halts accepting */
+  for (q = 0; q < n; q++) {
+    s = &tm->states[q];
+    if (s->is_acc && s->tr_inputs_count == 0) {
+      s->acc_dist = 0;
+      queue[tail++] = q;
+    } else {
+      s->acc_dist = LONG_MAX;
+    }
+  }
+  while (head < tail) {
+    q = queue[head++];
+    for (int j = in_first[q]; j < in_first[q + 1]; j++) {
+      s = &tm->states[in_states[j]];
+      if (s->acc_dist == LONG_MAX) {
+        s->acc_dist = tm->states[q].acc_dist + 1;
+        queue[tail++] = in_states[j];
+      }
+    }
+  }
 
-  return b;
+  free(in_first);
+  free(in_states);
+  free(queue);
 }
 
-/* Makes a private copy of the tape, in a copy-on-write fashion */
-void tape_make_private(branch_t * branch) {
-  tape_t * parent = branch->tape;
-  page_t *p_parent, *p_child;
+/** Maps the symbols to dense IDs, BLANK being BLANK_ID, and rewrites the
+  * loaded transitions with them. Symbols are split in classes like the
+  * states of a DFA being minimized: two symbols stay together while, in
+  * every state, they have the same transitions up to the class of the
+  * written symbol. All the symbols never read by any transition end up in
+  * one class. Returns whether the IDs fit in 4 bits, so that tapes can be
+  * bit-packed.
+  */
+bool tm_compress_alphabet(tm_t * tm) {
+  alphabet_t * a = &tm->alpha;
+  int cls[UCHAR_MAX + 1], next[UCHAR_MAX + 1], rep[UCHAR_MAX + 1];
+  long int first[UCHAR_MAX + 2], n = tm->sigs_count, k;
+  bool used[UCHAR_MAX + 1] = { false };
+  int count = 1, prev;
+  tr_sig_t * sigs = tm->sigs;
 
-  /* Create a new tape descriptor */
-  branch->tape = (tape_t *) malloc(sizeof(tape_t));
-  branch->tape->ref_count = 1;
-  parent->ref_count--;
+  for (k = 0; k < n; k++) {
+    used[sigs[k].input] = true;
+    used[sigs[k].output] = true;
+  }
 
-  /* Copy pages */
-  p_parent = parent->first_page;
-  p_child = NULL;
-  while (p_parent != NULL) {
-    /* Copy each page's memory */
-    p_child = page_create(p_child, NULL, p_parent->mem);
-    if (p_child->prev != NULL) {
-      p_child->prev->next = p_child; /* Link next to previous */
-    } else {
-      branch->tape->first_page = p_child; /* First page */
+  /* Refine the classes, starting from a single one, until they are stable */
+  for (int c = 0; c <= UCHAR_MAX; c++) {
+    cls[c] = 0;
+  }
+  do {
+    prev = count;
+    /* Sort the transitions by input, with the current output classes */
+    for (k = 0; k < n; k++) {
+      sigs[k].out_class = (unsigned char) cls[sigs[k].output];
+    }
+    qsort(sigs, n, sizeof(tr_sig_t), tr_sig_cmp);
+    for (int c = 0, k = 0; c <= UCHAR_MAX + 1; c++) {
+      while (k < n && sigs[k].input < c) {
+        k++;
+      }
+      first[c] = k;
     }
 
-    /* Set the same head page */
-    if (p_parent == branch->head_page) {
-      branch->head_page = p_child;
+    /* A symbol joins the first class of its own with the same transitions */
+    count = 0;
+    for (int c = 0; c <= UCHAR_MAX; c++) {
+      next[c] = -1;
+      for (int r = 0; r < count && next[c] < 0; r++) {
+        if (cls[rep[r]] == cls[c] &&
+            tr_sig_same(&sigs[first[rep[r]]], first[rep[r] + 1] - first[rep[r]],
+                        &sigs[first[c]], first[c + 1] - first[c])) {
+          next[c] = r;
+        }
+      }
+      if (next[c] < 0) { /* New class */
+        rep[count] = c;
+        next[c] = count++;
+      }
     }
+    memcpy(cls, next, sizeof(cls));
+  } while (count != prev);
 
-    p_parent = p_parent->next;
+  /* Swap IDs so that BLANK gets BLANK_ID */
+  prev = cls[(unsigned char) BLANK];
+  for (int c = 0; c <= UCHAR_MAX; c++) {
+    a->code[c] = (unsigned char) (cls[c] == prev ? BLANK_ID :
+                                  cls[c] == BLANK_ID ? prev : cls[c]);
   }
-}
-
-/* Destroy branch and deallocate memory */
-void branch_destroy(branch_t * branch) {
-  /* De-reference the tape */
-  branch->tape->ref_count--;
-  if (branch->tape->ref_count == 0) {
-    LOG("DEBUG: Clearing unreferenced tape\n");
-    /* If the tape isn't referenced by any branch, free it */
-    page_t *p, *p_next;
-
-    /* Delete pages */
-    p = branch->tape->first_page;
-    while (p != NULL) {
-      p_next = p->next;
-      free(p);
-      p = p_next;
+  a->size = count;
+  a->used = 0;
+  for (int c = 0; c <= UCHAR_MAX; c++) {
+    a->used += used[c];
+  }
+  /* Print each ID as a symbol used by the transitions, if any */
+  memset(a->sym, 0, sizeof(a->sym));
+  for (int c = UCHAR_MAX; c >= 0; c--) {
+    if (used[c] || a->sym[a->code[c]] == 0) {
+      a->sym[a->code[c]] = (char) c;
     }
+  }
+  a->sym[BLANK_ID] = BLANK;
 
-    /* Delete the tape descipror */
-    free(branch->tape);
+  /** Rewrite the transitions: merged inputs now have the same ones, and
+    * transitions which only differed by merged outputs are duplicates,
+    * that would fork identical branches; tm_index_transitions drops them.
+    */
+  for (k = 0; k < n; k++) {
+    sigs[k].input = a->code[sigs[k].input];
+    sigs[k].output = a->code[sigs[k].output];
   }
 
-  /* Delete the branch itself */
-  free(branch);
+  a->bits = a->size <= 2 ? 1 : a->size <= 4 ? 2 : a->size <= 16 ? 4 : 0;
+  if (a->bits == 0) {
+    return false;
+  }
+  a->cell_shift = a->bits == 1 ? 3 : a->bits == 2 ? 2 : 1;
+  a->cpp = PAGE_SIZE << a->cell_shift;
+  return true;
 }
 
-/* Return output transition list */
-tr_input_t * search_tr_input(tr_input_t * v, int p, int r, char key) {
-  /* Sequential search has proven to be faster in tests */
-  while(p <= r) {
-    if (v[p].input == key) {
-      return &v[p];
-    }
-    p++;
+/* Orders transitions by input, state, next state, output class and move */
+int tr_sig_cmp(const void * a, const void * b) {
+  const tr_sig_t * x = (const tr_sig_t *) a;
+  const tr_sig_t * y = (const tr_sig_t *) b;
+  if (x->input != y->input) {
+    return x->input < y->input ? -1 : 1;
   }
-  return NULL;
+  return tr_sig_cmp_tail(x, y);
 }
 
-/* Computes one string from stdin and returns the response 0, 1, U */
-char tm_run(tm_t * tm) {
-  branch_t *root, *b;
-  char c;
-  long int reads = 0;
-
-  /* 1. Create the "root" branch */
-  root = (branch_t *) malloc(sizeof(branch_t));
-  root->head_page = NULL; /* Will cause page fault */
-  root->tape = (tape_t *) malloc(sizeof(tape_t));
-  root->tape->first_page = NULL;
-  root->tape->ref_count = 1;
-  root->head_pos = 0;
-  root->steps = 0;
-  root->tr = NULL;
-  root->state = &tm->states[INITIAL_STATE];
-
-  /* 2. Load the input string */
-  c = getchar();
-  while (c != '\n' && c != EOF) {
-    /* Read the string till the end or max_steps */
-    if (reads <= tm->max_steps) {
-      head_write(root, c);
-      head_move(root, 'R');
-    }
-    c = getchar();
-    reads++;
-  }
-  /* Reset head's position */
-  root->head_page = root->tape->first_page;
-  root->head_pos = 0;
-
-  /* 3. Run the computation */
-  rq_enqueue(tm, root);
-  c = tm_compute_rq(tm);
+/* Orders transitions by state, next state, output class and move */
+int tr_sig_cmp_tail(const tr_sig_t * x, const tr_sig_t * y) {
+  if (x->state != y->state) {
+    return x->state < y->state ? -1 : 1;
+  }
+  if (x->next != y->next) {
+    return x->next < y->next ? -1 : 1;
+  }
+  if (x->out_class != y->out_class) {
+    return x->out_class < y->out_class ? -1 : 1;
+  }
+  return x->move - y->move;
+}
 
-  /* 4. Empty the runqueue */
-  while(tm->rq_head != NULL) {
-    b = rq_dequeue(tm);
-    branch_destroy(b);
+/* Orders transitions by state, input, next state, output and move */
+int tr_sig_state_cmp(const void * a, const void * b) {
+  const tr_sig_t * x = (const tr_sig_t *) a;
+  const tr_sig_t * y = (const tr_sig_t *) b;
+  if (x->state != y->state) {
+    return x->state < y->state ? -1 : 1;
+  }
+  if (x->input != y->input) {
+    return x->input < y->input ? -1 : 1;
   }
+  if (x->next != y->next) {
+    return x->next < y->next ? -1 : 1;
+  }
+  if (x->output != y->output) {
+    return x->output < y->output ? -1 : 1;
+  }
+  return x->move - y->move;
+}
 
-  /* Return evaluation */
-  return c;
+/** Tells whether two sorted runs of transitions are the same,
+  * apart from their input and duplicates
+  */
+bool tr_sig_same(tr_sig_t * x, long int xn, tr_sig_t * y, long int yn) {
+  long int i = 0, j = 0;
+  while (i < xn && j < yn) {
+    if (tr_sig_cmp_tail(&x[i], &y[j]) != 0) {
+      return false;
+    }
+    do {
+      i++;
+    } while (i < xn && tr_sig_cmp_tail(&x[i - 1], &x[i]) == 0);
+    do {
+      j++;
+    } while (j < yn && tr_sig_cmp_tail(&y[j - 1], &y[j]) == 0);
+  }
+  return i == xn && j == yn;
 }
 
-/** Execute the runqueue until it's empty or a final state is reached.
-  * The execution strategy is simple a Breadth-First approach.
-  * Return code: 0: refuse, 1: accept, U: undetermined
+/** Builds the transition index from the loaded transitions, with one sort:
+  *  - all the transitions are stored in one array, each state's inputs in
+  *    a slice of another one, sorted by ID;
+  *  - each state has a bitmap of the IDs it has transitions for, so that
+  *    the position of an input in the slice is the count of the bits
+  *    below it. That is 8 bytes per state for up to 64 IDs.
   */
-char tm_compute_rq(tm_t * tm) {
-  branch_t * b;
+void tm_index_transitions(tm_t * tm) {
+  tr_sig_t * sigs = tm->sigs;
+  long int n = 0, inputs = 0;
+  tr_input_t * tr_in = NULL;
+  tr_output_t * tr;
+  uint64_t * mask;
   state_t * s;
-  bool has_preempted = false;
 
-  while (tm->rq_head != NULL) {
-    b = rq_dequeue(tm); /* Branch to be executed */
+  qsort(sigs, tm->sigs_count, sizeof(tr_sig_t), tr_sig_state_cmp);
+  for (long int k = 0; k < tm->sigs_count; k++) { /* Drop duplicates */
+    if (n == 0 || tr_sig_state_cmp(&sigs[n - 1], &sigs[k]) != 0) {
+      sigs[n++] = sigs[k];
+      if (n == 1 || sigs[n - 2].state != sigs[n - 1].state ||
+          sigs[n - 2].input != sigs[n - 1].input) {
+        inputs++;
+      }
+    }
+  }
+
+  tm->tr_words = (tm->alpha.size + 63) / 64;
+  tm->tr_masks = (uint64_t *)
+          calloc((tm->max_state + 1) * (long int) tm->tr_words, sizeof(uint64_t));
+  tm->tr_inputs = (tr_input_t *)
+          malloc((inputs > 0 ? inputs : 1) * sizeof(tr_input_t));
+  tm->tr_outputs = (tr_output_t *)
+          malloc((n > 0 ? n : 1) * sizeof(tr_output_t));
+
+  inputs = 0;
+  for (long int k = 0; k < n; k++) {
+    tr = &tm->tr_outputs[k];
+    tr->state = sigs[k].next;
+    tr->output = (char) sigs[k].output;
+    tr->move = sigs[k].move;
+    tr->next = NULL;
+    if (k > 0 && sigs[k - 1].state == sigs[k].state &&
+        sigs[k - 1].input == sigs[k].input) { /* Same input, link it */
+      tm->tr_outputs[k - 1].next = tr;
+      continue;
+    }
+    /* New input */
+    s = &tm->states[sigs[k].state];
+    tr_in = &tm->tr_inputs[inputs++];
+    if (s->tr_inputs_count == 0) {
+      s->tr_inputs = tr_in;
+    }
+    s->tr_inputs_count++;
+    tr_in->input = (char) sigs[k].input;
+    tr_in->transitions = tr;
+    mask = &tm->tr_masks[sigs[k].state * (long int) tm->tr_words];
+    mask[sigs[k].input >> 6] |= (uint64_t) 1 << (sigs[k].input & 63);
+  }
+
+  tm->tr_count = n;
+  tm->deterministic = n == inputs; /* One branch, it never forks */
+  LOG("INFO: Indexed %ld transitions on %ld inputs\n", n, inputs);
+  free(tm->sigs);
+  tm->sigs = NULL;
+  tm->sigs_count = 0;
+  tm->sigs_cap = 0;
+}
+
+/* Creates and initialises a private memory page */
+page_t * page_create(char * mem) {
+  LOG("DEBUG: Creating new page\n");
+  page_t * p = (page_t *) malloc(sizeof(page_t));
+  mem_held += sizeof(page_t);
+  p->ref_count = 1;
+  p->interned = false;
+
+  if (mem == NULL) { /* If no memory to copy is given, intialize blank one */
+    memset(p->mem, BLANK_ID, PAGE_SIZE);
+  } else { /* Copy the memory */
+    memcpy(p->mem, mem, PAGE_SIZE);
+  }
+  counters.pages++;
+  STAT(stats.pages++);
+  STAT_PEAK(stats.peak_pages, stats.pages);
+  return p;
+}
+
+/* Drops a reference to a page, freeing it when it is unreferenced */
+void page_release(page_t * p) {
+  p->ref_count--;
+  if (p->ref_count == 0) {
+    if (p->interned) {
+      store_remove(p);
+    }
+    free(p);
+    mem_held -= sizeof(page_t);
+    counters.pages--;
+    STAT(stats.pages--);
+  }
+}
+
+/* Hashes the content of a page, one machine word at a time */
+unsigned int page_hash(char * mem) {
+  uint64_t h = 0, w;
+  for (int i = 0; i < PAGE_SIZE; i += sizeof(uint64_t)) {
+    memcpy(&w, mem + i, sizeof(uint64_t));
+    h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 29;
+  }
+  return (unsigned int) (h ^ (h >> 32));
+}
+
+/** Interns a private page (referenced once) in the store.
+  * If an identical page is already interned, the given page is freed
+  * and the interned one is returned with an additional reference.
+  */
+page_t * page_intern(page_t * p) {
+  page_t * q;
+  unsigned int hash = page_hash(p->mem);
+
+  STAT(stats.interns++);
+  for (q = store.buckets[hash & store.mask]; q != NULL; q = q->bucket_next) {
+    if (q->hash == hash && memcmp(q->mem, p->mem, PAGE_SIZE) == 0) {
+      STAT(stats.intern_hits++);
+      q->ref_count++;
+      page_release(p);
+      return q;
+    }
+  }
+
+  /* New content, the page itself becomes the interned copy */
+  p->hash = hash;
+  store_insert(p);
+  return p;
+}
+
+/* Initialises the page store, together with its blank page */
+void store_init() {
+  store.mask = STORE_INITIAL_BUCKETS - 1;
+  store.count = 0;
+  store.buckets = (page_t **) calloc(STORE_INITIAL_BUCKETS, sizeof(page_t *));
+  /* The store keeps a reference to the blank page, so it is never freed */
+  store.blank = page_intern(page_create(NULL));
+  store.input = page_create(NULL);
+  store.input->interned = true; /* Written cells are copied out of it */
+}
+
+/* Deallocates the page store */
+void store_destroy() {
+  page_release(store.blank);
+  store.input->interned = false; /* It is not in the buckets */
+  page_release(store.input);
+  free(store.buckets);
+  store.buckets = NULL;
+}
+
+/* Adds a page to the store, doubling the buckets when they are full */
+void store_insert(page_t * p) {
+  page_t **buckets, *q, *q_next;
+  unsigned int mask;
+
+  if (store.count > store.mask) { /* Rehash into twice as many buckets */
+    mask = store.mask * 2 + 1;
+    buckets = (page_t **) calloc(mask + 1, sizeof(page_t *));
+    for (unsigned int i = 0; i <= store.mask; i++) {
+      for (q = store.buckets[i]; q != NULL; q = q_next) {
+        q_next = q->bucket_next;
+        q->bucket_next = buckets[q->hash & mask];
+        buckets[q->hash & mask] = q;
+      }
+    }
+    free(store.buckets);
+    store.buckets = buckets;
+    store.mask = mask;
+  }
+
+  p->interned = true;
+  p->bucket_next = store.buckets[p->hash & store.mask];
+  store.buckets[p->hash & store.mask] = p;
+  store.count++;
+}
+
+/* Removes a page from the store, so that it can be modified again */
+void store_remove(page_t * p) {
+  page_t ** link = &store.buckets[p->hash & store.mask];
+  while (*link != p) {
+    link = &(*link)->bucket_next;
+  }
+  *link = p->bucket_next;
+  p->interned = false;
+  store.count--;
+}
+
+/** Creates a branch in the initial state, with the head on cell 0 and
+  * count cells from first on its tape.
+  */
+branch_t * branch_create(tm_t * tm, const char * cells, long int first,
+                         long int count) {
+  branch_t * b = (branch_t *) malloc(sizeof(branch_t));
+  mem_held += sizeof(branch_t);
+  b->tape = tape_create(tm->tape_ops);
+  b->tape->alpha = &tm->alpha;
+  if (tm->tape_ops == &flat_tape && /* Room for any head, see flat_reserve */
+      !flat_reserve(b->tape, tm->max_steps)) {
+    b->tape->ops = &paged_tape; /* Out of mappings, see flat_make_private */
+  }
+  b->steps = 0;
+  b->tr = NULL;
+  b->state = &tm->states[INITIAL_STATE];
+  b->states = (uint64_t) 1 << INITIAL_STATE;
+  b->cell = 0;
+  b->lo = first < 0 ? first : 0;
+  b->hi = first + count - 1 > 0 ? first + count - 1 : 0;
+  branch_regrow(tm, b);
+  counters.branches_created++;
+
+  b->tape->ops->seek(b, first);
+  for (long int i = 0; i < count; i++) {
+    head_write(b, cells[i]);
+    head_move(b, 'R');
+  }
+  /* Reset head's position, the first cell may still be a virtual blank */
+  b->tape->ops->seek(b, 0);
+  return b;
+}
+
+/* Creates a new branch from its parent, the memory is shared */
+branch_t * branch_clone(branch_t * parent, tr_output_t * tr) {
+  branch_t * b;
+
+  /* Allocate structure */
+  b = (branch_t *) malloc(sizeof(branch_t));
+  mem_held += sizeof(branch_t);
+
+  /* Freeze the tape content before sharing it */
+  if (parent->tape->ref_count == 1 && parent->tape->ops->share != NULL) {
+    parent->tape->ops->share(parent);
+  }
+
+  /* Copy static variables, including the head */
+  *b = *parent;
+  b->tr = tr;
+
+  /* Share memory with parent */
+  b->tape->ref_count++;
+  counters.branches_created++;
+
+  return b;
+}
+
+/* Follows the head of a branch, growing its region when it leaves it */
+void branch_track(tm_t * tm, branch_t * b, char move) {
+  b->cell += (move == 'R') - (move == 'L');
+  if (b->cell < b->lo) {
+    b->lo = b->cell;
+    branch_regrow(tm, b);
+  } else if (b->cell > b->hi) {
+    b->hi = b->cell;
+    branch_regrow(tm, b);
+  }
+}
+
+/** Called when the region of a branch grows, its cells outside having
+  * never changed: it can only take as many configurations as the states
+  * times the contents of the region times the head positions in it.
+  * Taking more steps than that without growing, it repeats one of them.
+  * Whatever follows the repeated configuration also follows its first
+  * occurrence, in fewer steps, so the branch cannot accept first.
+  */
+void branch_regrow(tm_t * tm, branch_t * b) {
+  long int n = b->hi - b->lo + 1;
+  b->loop_at = n < tm->loop_cells ? b->steps + tm->loop_bounds[n] : LONG_MAX;
+}
+
+/** Computes the configurations in regions of each size, as long as they
+  * are within max steps: larger regions are never found looping.
+  */
+void tm_loop_bounds(tm_t * tm) {
+  long int states = tm->max_state + 1, ids = tm->alpha.size, contents = 1;
+  int n;
+
+  /* With 2 IDs or more, ids^n overflows before n reaches LOOP_MAX_CELLS */
+  tm->loop_bounds = (long int *) malloc(LOOP_MAX_CELLS * sizeof(long int));
+  tm->loop_bounds[0] = 0;
+  for (n = 1; n < LOOP_MAX_CELLS; n++) {
+    if (contents > tm->max_steps / ids / states / n) {
+      break; /* Preempted first */
+    }
+    contents *= ids;
+    tm->loop_bounds[n] = states * contents * n;
+  }
+  tm->loop_cells = n > 1 ? n : 0;
+  LOG("INFO: Loops detected in regions of less than %d cells\n", n);
+}
+
+/* Creates an empty tape of the given backend, referenced by one branch */
+tape_t * tape_create(const tape_ops_t * ops) {
+  tape_t * t = (tape_t *) calloc(1, sizeof(tape_t));
+  mem_held += sizeof(tape_t);
+  t->ref_count = 1;
+  t->ops = ops;
+  return t;
+}
+
+/* Releases the pages of an unreferenced tape and deallocates it */
+void tape_destroy(tape_t * t) {
+  for (int i = 0; i < t->page_count; i++) {
+    if (t->pages[i] != NULL) { /* Skip packed pages */
+      page_release(t->pages[i]);
+      STAT(stats.page_refs--);
+    }
+  }
+  if (t->pages != NULL) {
+    free(t->pages - t->room_left);
+  }
+  free(t->packed);
+  mem_held -= sizeof(tape_t) + t->packed_len + sizeof(page_t *) *
+              (t->room_left + t->page_count + t->room_right);
+  free(t);
+}
+
+/* Returns the page with the given number, NULL if it is not materialized */
+page_t * tape_page_at(tape_t * t, long int pnum) {
+  unsigned long int i = (unsigned long int) (pnum - t->first_pnum);
+  return i < (unsigned long int) t->page_count ? t->pages[i] : NULL;
+}
+
+/** Interns every page written since the tape was last shared,
+  * so that all the pages of a shared tape are immutable and deduplicated.
+  * NOTE: the tape must be referenced only by the given branch
+  */
+void tape_seal(branch_t * b) {
+  tape_t * t = b->tape;
+  page_t *p, *q;
+
+  for (int i = 0; i < t->page_count; i++) {
+    p = t->pages[i];
+    if (!p->interned) {
+      q = page_intern(p);
+      if (b->head_page == p) { /* Keep the head on the interned copy */
+        b->head_page = q;
+      }
+      t->pages[i] = q;
+    }
+  }
+}
+
+/** Makes a private copy of the tape, in a copy-on-write fashion.
+  * Only the page handles are copied: pages are shared until written.
+  */
+void tape_make_private(branch_t * branch) {
+  tape_t * parent = branch->tape;
+  tape_t * t;
+
+  /* Create a new tape descriptor */
+  t = tape_create(parent->ops);
+  t->alpha = parent->alpha;
+  t->settled = parent->settled;
+  t->first_pnum = parent->first_pnum;
+  t->page_count = parent->page_count;
+  t->source = parent->source;
+  t->source_len = parent->source_len;
+  parent->ref_count--;
+  branch->tape = t;
+
+  /* Reference the same pages, which are all interned */
+  if (t->page_count > 0) {
+    t->pages = (page_t **) malloc(t->page_count * sizeof(page_t *));
+    mem_held += t->page_count * sizeof(page_t *);
+    counters.cow_bytes += t->page_count * sizeof(page_t *);
+    for (int i = 0; i < t->page_count; i++) {
+      t->pages[i] = parent->pages[i];
+      t->pages[i]->ref_count++;
+    }
+    STAT(stats.page_refs += t->page_count);
+    STAT_PEAK(stats.peak_page_refs, stats.page_refs);
+  }
+}
+
+/* Makes sure that there is room for more pages on both sides of the tape */
+void tape_reserve(tape_t * t, int left, int right) {
+  page_t ** base;
+  int room;
+
+  if (t->room_left >= left && t->room_right >= right) {
+    return;
+  }
+  /* Reallocate, leaving as much room as the current size on both sides */
+  room = t->page_count > 1 ? t->page_count : 1;
+  left += room;
+  right += room;
+  base = (page_t **) malloc((left + t->page_count + right) * sizeof(page_t *));
+  mem_held += (left - t->room_left + right - t->room_right) * sizeof(page_t *);
+  if (t->pages != NULL) {
+    memcpy(base + left, t->pages, t->page_count * sizeof(page_t *));
+    free(t->pages - t->room_left);
+  }
+  t->pages = base + left;
+  t->room_left = left;
+  t->room_right = right;
+}
+
+/** Extends the materialized region up to the head with the blank page,
+  * so that the head cell can be written.
+  * NOTE: the tape must be private
+  */
+void tape_materialize(branch_t * b) {
+  tape_t * t = b->tape;
+  page_t ** slots;
+  long int first, input_pages = (t->source_len + PAGE_SIZE - 1) / PAGE_SIZE;
+  int n;
+
+  if (t->page_count == 0) { /* Empty tape, the region starts at the head */
+    t->first_pnum = b->head_pnum;
+  }
+
+  if (b->head_pnum < t->first_pnum) { /* Extend the region on the left */
+    n = (int) (t->first_pnum - b->head_pnum);
+    tape_reserve(t, n, 0);
+    t->pages -= n;
+    t->room_left -= n;
+    t->first_pnum -= n;
+    slots = t->pages;
+    first = t->first_pnum;
+  } else { /* Extend the region on the right */
+    n = (int) (b->head_pnum - t->first_pnum) - t->page_count + 1;
+    tape_reserve(t, 0, n);
+    t->room_right -= n;
+    slots = t->pages + t->page_count;
+    first = t->first_pnum + t->page_count;
+  }
+  t->page_count += n;
+
+  /* Fill the new slots with the blank page, or the input one where
+     a mapped tape still holds its input */
+  for (int i = 0; i < n; i++) {
+    slots[i] = first + i >= 0 && first + i < input_pages ? store.input :
+                                                           store.blank;
+    slots[i]->ref_count++;
+  }
+  STAT(stats.page_refs += n);
+  STAT_PEAK(stats.peak_page_refs, stats.page_refs);
+
+  b->head_page = t->pages[b->head_pnum - t->first_pnum];
+}
+
+/** Makes the head page writable: an interned page is either taken out of
+  * the store, if this tape is its only user, or copied.
+  * NOTE: the tape must be private
+  */
+void head_page_make_private(branch_t * b) {
+  page_t * p = b->head_page;
+  tape_t * t = b->tape;
+
+  if (p->ref_count == 1) { /* Nobody else can see it */
+    store_remove(p);
+  } else { /* Copy-on-write */
+    LOG("DEBUG: Copying shared page\n");
+    b->head_page = page_create(p->mem);
+    counters.cow_bytes += PAGE_SIZE;
+    t->pages[b->head_pnum - t->first_pnum] = b->head_page;
+    page_release(p);
+  }
+}
+
+/* Returns the page number of an absolute cell position */
+long int cell_page(long int cell, long int cpp) {
+  /* Round towards minus infinity, also for negative positions */
+  return cell >= 0 ? cell / cpp : -((-cell - 1) / cpp) - 1;
+}
+
+/** Releases the pages that the head cannot reach anymore, being
+  * farther than reach cells away from it.
+  * NOTE: the tape must be private
+  */
+void tape_trim(branch_t * b, long int reach) {
+  tape_t * t = b->tape;
+  long int cpp = t->ops == &packed_tape ? t->alpha->cpp : PAGE_SIZE;
+  long int cell, lo, hi;
+  int n;
+
+  if (reach > LONG_MAX / 4) { /* Everything is reachable */
+    return;
+  }
+  cell = b->head_pnum * cpp + b->head_pos;
+  lo = cell_page(cell - reach, cpp) - t->first_pnum; /* First reachable slot */
+  hi = cell_page(cell + reach, cpp) - t->first_pnum; /* Last reachable slot */
+
+  /* Drop the slots on the right */
+  while (t->page_count > 0 && t->page_count - 1 > hi) {
+    t->page_count--;
+    t->room_right++;
+    page_release(t->pages[t->page_count]);
+    STAT(stats.page_refs--);
+  }
+
+  /* Drop the slots on the left */
+  n = lo <= 0 ? 0 : lo < t->page_count ? (int) lo : t->page_count;
+  if (n > 0) {
+    LOG("DEBUG: Trimming %d unreachable pages\n", n);
+    for (int i = 0; i < n; i++) {
+      page_release(t->pages[i]);
+    }
+    STAT(stats.page_refs -= n);
+    t->pages += n;
+    t->room_left += n;
+    t->page_count -= n;
+    t->first_pnum += n;
+  }
+}
+
+/** Tells whether the branch could still halt in an acceptance state
+  * within the remaining steps, judging from the state graph.
+  */
+bool branch_can_accept(tm_t * tm, branch_t * b) {
+  long int left = tm->max_steps - b->steps;
+  if (b->tr == NULL) {
+    return b->state->acc_dist <= left;
+  }
+  /* The pending transition takes one step */
+  return tm->states[b->tr->state].acc_dist < left;
+}
+
+/** Packs the pages owned by the tape while the branch waits in the queue.
+  * Pages made of a single char are run-length encoded by interning them,
+  * so that all the tapes share them, the others are compressed together.
+  * NOTE: the tape must be private
+  */
+void tape_pack(branch_t * b) {
+  tape_t * t = b->tape;
+  page_t * p;
+  char *raw = NULL, *buf;
+  int mixed = 0, len;
+
+  for (int i = 0; i < t->page_count; i++) {
+    p = t->pages[i];
+    if (p->interned) { /* Already shared, or shareable */
+      continue;
+    }
+    if (memcmp(p->mem, p->mem + 1, PAGE_SIZE - 1) == 0) { /* Single char */
+      t->pages[i] = page_intern(p);
+    } else {
+      if (mixed == 0) { /* Room for all the remaining pages */
+        raw = (char *) malloc((t->page_count - i) * PAGE_SIZE);
+      }
+      memcpy(raw + mixed * PAGE_SIZE, p->mem, PAGE_SIZE);
+      mixed++;
+    }
+  }
+
+  if (mixed > 0) {
+    buf = (char *) malloc(lz_bound(mixed * PAGE_SIZE));
+    len = lz_compress(raw, mixed * PAGE_SIZE, buf);
+    if (len < mixed * PAGE_SIZE) { /* Worth it, release the pages */
+      STAT(stats.packs++);
+      STAT(stats.packed_in += mixed * PAGE_SIZE);
+      STAT(stats.packed_out += len);
+      for (int i = 0; i < t->page_count; i++) {
+        if (!t->pages[i]->interned) {
+          page_release(t->pages[i]);
+          t->pages[i] = NULL;
+          STAT(stats.page_refs--);
+        }
+      }
+      t->packed = (char *) realloc(buf, len);
+      t->packed_len = len;
+      mem_held += len;
+    } else {
+      free(buf);
+    }
+    free(raw);
+  }
+  b->head_page = tape_page_at(t, b->head_pnum); /* NULL if packed */
+}
+
+/* Restores the pages of a packed tape before the branch is executed */
+void tape_unpack(branch_t * b) {
+  tape_t * t = b->tape;
+  char * raw;
+  int mixed = 0;
+
+  /* The packed pages are the NULL slots, in order */
+  for (int i = 0; i < t->page_count; i++) {
+    mixed += t->pages[i] == NULL;
+  }
+  raw = (char *) malloc(mixed * PAGE_SIZE);
+  lz_decompress(t->packed, mixed * PAGE_SIZE, raw);
+  free(t->packed);
+  t->packed = NULL;
+  mem_held -= t->packed_len;
+  t->packed_len = 0;
+
+  mixed = 0;
+  for (int i = 0; i < t->page_count; i++) {
+    if (t->pages[i] == NULL) {
+      t->pages[i] = page_create(raw + mixed * PAGE_SIZE);
+      mixed++;
+      STAT(stats.page_refs++);
+    }
+  }
+  free(raw);
+  b->head_page = tape_page_at(t, b->head_pnum);
+}
+
+/* Destroy branch and deallocate memory */
+void branch_destroy(branch_t * branch) {
+  /* De-reference the tape */
+  branch->tape->ref_count--;
+  if (branch->tape->ref_count == 0) {
+    LOG("DEBUG: Clearing unreferenced tape\n");
+    /* If the tape isn't referenced by any branch, free it */
+    branch->tape->ops->destroy(branch->tape);
+  }
+
+  /* Delete the branch itself */
+  free(branch);
+  mem_held -= sizeof(branch_t);
+  counters.branches_destroyed++;
+}
+
+/**
+  * COMPRESSION
+  * A small LZ77 codec in the spirit of LZ4: a sequence of tokens, each made
+  * of some literals followed by a match (offset, length) into the output.
+  * The token byte holds both lengths, 15 meaning that more bytes follow.
+  */
+
+/* Returns the maximum compressed size of n bytes */
+int lz_bound(int n) {
+  return n + n / 255 + 16;
+}
+
+/* Writes a length in the 255-continued format, returns the bytes used */
+static int lz_put_len(char * dst, int len) {
+  int n = 0;
+  while (len >= 255) {
+    dst[n++] = (char) 255;
+    len -= 255;
+  }
+  dst[n++] = (char) len;
+  return n;
+}
+
+/* Compresses n bytes into dst, which must hold lz_bound(n) bytes */
+int lz_compress(char * src, int n, char * dst) {
+  int table[1 << LZ_HASH_BITS]; /* Last position + 1 of each hash */
+  int ip = 0, anchor = 0, op = 0, ref, lit, len, token, bits = 4;
+  uint32_t seq;
+
+  /* Small inputs only need (and only clear) a small table */
+  while (bits < LZ_HASH_BITS && (1 << bits) < n) {
+    bits++;
+  }
+  memset(table, 0, sizeof(int) << bits);
+
+  while (ip + LZ_MIN_MATCH <= n) {
+    memcpy(&seq, src + ip, sizeof(seq));
+    seq = (seq * 2654435761U) >> (32 - bits);
+    ref = table[seq] - 1;
+    table[seq] = ip + 1;
+    if (ref < 0 || ip - ref > 0xFFFF ||
+        memcmp(src + ref, src + ip, LZ_MIN_MATCH) != 0) {
+      ip++;
+      continue;
+    }
+
+    /* Extend the match as far as possible */
+    len = LZ_MIN_MATCH;
+    while (ip + len < n && src[ref + len] == src[ip + len]) {
+      len++;
+    }
+
+    /* Emit the token, the literals and the match */
+    lit = ip - anchor;
+    token = (lit < 15 ? lit : 15) << 4;
+    token |= len - LZ_MIN_MATCH < 15 ? len - LZ_MIN_MATCH : 15;
+    dst[op++] = (char) token;
+    if (lit >= 15) {
+      op += lz_put_len(dst + op, lit - 15);
+    }
+    memcpy(dst + op, src + anchor, lit);
+    op += lit;
+    dst[op++] = (char) ((ip - ref) & 0xFF);
+    dst[op++] = (char) ((ip - ref) >> 8);
+    if (len - LZ_MIN_MATCH >= 15) {
+      op += lz_put_len(dst + op, len - LZ_MIN_MATCH - 15);
+    }
+    ip += len;
+    anchor = ip;
+  }
+
+  /* The last token only has literals */
+  lit = n - anchor;
+  dst[op++] = (char) ((lit < 15 ? lit : 15) << 4);
+  if (lit >= 15) {
+    op += lz_put_len(dst + op, lit - 15);
+  }
+  memcpy(dst + op, src + anchor, lit);
+  return op + lit;
+}
+
+/* Decompresses into dst, which gets exactly n bytes, returns the input used */
+int lz_decompress(char * src, int n, char * dst) {
+  unsigned char * in = (unsigned char *) src;
+  int ip = 0, op = 0, lit, len, off, c;
+
+  while (true) {
+    c = in[ip++];
+    lit = c >> 4;
+    if (lit == 15) {
+      do {
+        lit += in[ip];
+      } while (in[ip++] == 255);
+    }
+    memcpy(dst + op, in + ip, lit);
+    ip += lit;
+    op += lit;
+    if (op >= n) { /* Last token */
+      return ip;
+    }
+
+    off = in[ip] | in[ip + 1] << 8;
+    ip += 2;
+    len = (c & 15) + LZ_MIN_MATCH;
+    if ((c & 15) == 15) {
+      do {
+        len += in[ip];
+      } while (in[ip++] == 255);
+    }
+    while (len-- > 0) { /* Byte by byte, the match may overlap */
+      dst[op] = dst[op - off];
+      op++;
+    }
+  }
+}
+
+/* Return output transition list of a state on a symbol ID, if any */
+tr_input_t * tm_find_tr_input(tm_t * tm, state_t * s, char input) {
+  uint64_t * mask = &tm->tr_masks[(s - tm->states) * (long int) tm->tr_words];
+  int id = (unsigned char) input, rank = 0;
+  uint64_t bit = (uint64_t) 1 << (id & 63);
+
+  if ((mask[id >> 6] & bit) == 0) {
+    return NULL;
+  }
+  /* The rank of the ID among the state's inputs is its index */
+  for (int w = 0; w < id >> 6; w++) {
+    rank += __builtin_popcountll(mask[w]);
+  }
+  rank += __builtin_popcountll(mask[id >> 6] & (bit - 1));
+  return &s->tr_inputs[rank];
+}
+
+/* Computes one string from stdin and returns the response 0, 1, U */
+char tm_run(tm_t * tm) {
+  branch_t *root, *b;
+  struct timespec end;
+  char c;
+  const char * source = NULL;
+  int in;
+  long int len = 0;
+
+  /* 1. Take the input string from the mapped file, for mapped tapes, or
+        read it till the end or max_steps */
+  if (tm->map != NULL) {
+    source = input_line(tm, &len);
+    if (len > tm->max_steps) {
+      len = tm->max_steps + 1;
+    }
+  }
+  in = source == NULL ? getc(tm->in) : EOF;
+  while (in != '\n' && in != EOF) {
+    if (len <= tm->max_steps) {
+      if (len == tm->line_cap) {
+        tm->line_cap = tm->line_cap > 0 ? tm->line_cap * 2 : 256;
+        tm->line = (char *) realloc(tm->line, tm->line_cap);
+      }
+      tm->line[len++] = (char) tm->alpha.code[in]; /* Store the symbol ID */
+    }
+    in = getc(tm->in);
+  }
+
+  /* 2. Try some random walks first, if asked: one accepting answers.
+        A deterministic machine has only one walk, the exact run */
+  tm->mem_base = mem_held;
+  tm_begin(tm);
+  if (tm->nfa != NULL && tm->explore == NULL && source == NULL) {
+    c = nfa_run(tm, len); /* No tape needed */
+  } else if (tm->probe_walks > 0 && !tm->deterministic && source == NULL &&
+             (c = tm_probe(tm, len)) != SYM_REFUSE) {
+    /* Accepted, or the walks reached a limit */
+  } else {
+    /* 3. Create the "root" branch, then run the computation */
+    if (source != NULL) { /* Its cells are the mapped ones */
+      root = branch_create(tm, NULL, 0, 0);
+      mapped_attach(tm, root, source, len);
+    } else {
+      root = branch_create(tm, tm->line, 0, len);
+    }
+    if (tm->deterministic && tm->explore == NULL) { /* No runqueue needed */
+      c = tm_compute_alone(tm, root);
+    } else if (tm->state_sets && tm->explore == NULL) {
+      rq_enqueue(tm, root);
+      c = tm_compute_sets(tm);
+    } else {
+      rq_enqueue(tm, root);
+      c = tm_compute_rq(tm);
+    }
+  }
+  if (tm->limit != NULL && !tm->quiet) {
+    fprintf(stderr, "Input %ld: %s reached, answering %c\n",
+      tm->inputs, tm->limit, c);
+  }
+
+  /* 4. Empty the runqueue */
+  while(tm->rq_head != NULL) {
+    b = rq_dequeue(tm);
+    branch_destroy(b);
+  }
+
+  if (tm->summary != NULL) { /* Record the cost of the input */
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    summary_record(tm->summary, tm->inputs,
+      (end.tv_sec - tm->started.tv_sec) * 1000000000ULL +
+      end.tv_nsec - tm->started.tv_nsec, tm->work, c);
+  }
+
+  /* Return evaluation */
+  return c;
+}
+
+/* Resets the counters and the limits for a new input */
+void tm_begin(tm_t * tm) {
+  tm->inputs++;
+  tm->work = 0;
+  tm->next_check = 0;
+  tm->limit = NULL;
+  tm->degraded = false;
+  tm->mem_limit = tm->mem_cap - tm->mem_cap / 4;
+  tm->progress_due = tm->progress_ms;
+  tm->report_work = 0;
+  tm->report_ms = 0;
+  clock_gettime(CLOCK_MONOTONIC, &tm->started);
+}
+
+/** Execute the runqueue until it's empty or a final state is reached.
+  * The execution strategy is simple a Breadth-First approach.
+  * Return code: 0: refuse, 1: accept, U: undetermined
+  */
+char tm_compute_rq(tm_t * tm) {
+  branch_t * b;
+  state_t * s;
+  bool has_preempted = false;
+
+  /* A worker of a distributed tree may get more branches when it is idle */
+  while (tm->rq_head != NULL ||
+         (tm->explore != NULL && explore_idle(tm, has_preempted))) {
+    if (tm->mem_cap > 0 && mem_held - tm->mem_base > tm->mem_limit &&
+        tm_reduce_memory(tm)) { /* The response is undetermined */
+      return SYM_UNDET;
+    }
+    b = rq_dequeue(tm); /* Branch to be executed */
 
     if (b->steps == tm->max_steps){ /* Check if preemption is needed */
       /* Preempt the branch */
       branch_destroy(b);
       has_preempted = true;
+    } else if (has_preempted && !branch_can_accept(tm, b)) {
+      /** The response is already undetermined unless some branch accepts,
+        * and this one cannot: it doesn't matter anymore.
+        */
+      LOG("DEBUG: Dropping branch that cannot accept\n");
+      branch_destroy(b);
+    } else if (b->tr != NULL && tm->work++ == tm->next_check &&
+               tm_check_limits(tm, b->steps)) {
+      /* Out of time or steps, the response is undetermined */
+      branch_destroy(b);
+      return SYM_UNDET;
     } else { /* No preemption => execute transition */
+      if (b->tape->packed != NULL) {
+        b->tape->ops->unpack(b);
+      }
+      if ((b->steps & (TRIM_PERIOD - 1)) == 0 && b->tape->ref_count == 1 &&
+          b->tape->ops->trim != NULL) {
+        /* Periodically release the cells out of the head's reach */
+        b->tape->ops->trim(b, tm->max_steps - b->steps);
+      }
       LOG_STATUS(tm, b);
       LOG_TAPE(b);
       s = tm_step(tm, b);
@@ -530,162 +2333,3657 @@ char tm_compute_rq(tm_t * tm) {
           LOG("DEBUG: Dequeuing dead branch\n");
           branch_destroy(b);
         }
+      } else if (tm->compress_above > 0 && tm->rq_len > tm->compress_above &&
+                 !tm->degraded && b->tape->ref_count == 1 &&
+                 b->tape->ops->pack != NULL) {
+        /** Wide frontier, pack the tape while the branch waits.
+          * Depth-first, it is likely to run next.
+          */
+        b->tape->ops->pack(b);
+      }
+    }
+  }
+
+  /** If we got here, computation has finished without reaching
+    * acceptance states.
+    * If we preempted a branch at least once, the machine could have terminated
+    * so the response must be undetermined.
+    */
+  return has_preempted ? SYM_UNDET : SYM_REFUSE;
+}
+
+/** Execute the runqueue as tm_compute_rq does, but each branch stands for
+  * a set of states, in b->states, on the same tape and head: the forks
+  * writing the same symbol and moving the same way make one branch,
+  * whose states are all stepped on the symbol read.
+  * Its pending transition, if any, only tells the write and the move;
+  * the states are the ones reached by it.
+  * Return code: 0: refuse, 1: accept, U: undetermined
+  */
+char tm_compute_sets(tm_t * tm) {
+  branch_t * b;
+  bool has_preempted = false;
+
+  while (tm->rq_head != NULL) {
+    if (tm->mem_cap > 0 && mem_held - tm->mem_base > tm->mem_limit &&
+        tm_reduce_memory(tm)) { /* The response is undetermined */
+      return SYM_UNDET;
+    }
+    b = rq_dequeue(tm);
+
+    if (b->steps == tm->max_steps) { /* Preempt all its states */
+      branch_destroy(b);
+      has_preempted = true;
+    } else if (has_preempted && !branch_sets_can_accept(tm, b)) {
+      branch_destroy(b); /* None of its states can accept anymore */
+    } else if (b->tr != NULL &&
+               (tm->work += __builtin_popcountll(b->states)) >
+               tm->next_check && tm_check_limits(tm, b->steps)) {
+      /* Out of time or steps, the response is undetermined */
+      branch_destroy(b);
+      return SYM_UNDET;
+    } else {
+      if (b->tape->packed != NULL) {
+        b->tape->ops->unpack(b);
+      }
+      if ((b->steps & (TRIM_PERIOD - 1)) == 0 && b->tape->ref_count == 1 &&
+          b->tape->ops->trim != NULL) {
+        b->tape->ops->trim(b, tm->max_steps - b->steps);
+      }
+      LOG_TAPE(b);
+      if (tm_step_set(tm, b)) {
+        LOG("INFO: Accepting...\n");
+        branch_destroy(b);
+        return SYM_ACCEPT;
+      } else if (b->states == 0) { /* All its states halted or looped */
+        branch_destroy(b);
+      } else if (tm->compress_above > 0 && tm->rq_len > tm->compress_above &&
+                 !tm->degraded && b->tape->ref_count == 1 &&
+                 b->tape->ops->pack != NULL) {
+        b->tape->ops->pack(b);
+      }
+    }
+  }
+  return has_preempted ? SYM_UNDET : SYM_REFUSE;
+}
+
+/** Executes the pending transition of a branch holding a set of states,
+  * then steps each state on the symbol read. The transitions are grouped
+  * by their write and move: the first group stays on the branch, the
+  * others get clones of it sharing the tape, all enqueued.
+  * Returns true if one of the states halts accepting. If none goes on,
+  * b->states is left empty and the branch is not enqueued.
+  */
+bool tm_step_set(tm_t * tm, branch_t * b) {
+  struct { /* A write and a move, with the states they lead to */
+    tr_output_t * tr;
+    uint64_t states;
+  } groups[tm->set_groups];
+  int count = 0, g, q;
+  tr_input_t * tr_in;
+  tr_output_t * tr;
+  state_t * s;
+  char input;
+
+  /* Execute the write and the move */
+  if (b->tr != NULL) {
+    head_write(b, b->tr->output);
+    head_move(b, b->tr->move);
+    b->steps++;
+    if (tm->loop_cells > 0) {
+      branch_track(tm, b, b->tr->move);
+    }
+  }
+
+  /* Group the transitions of all the states on the symbol read */
+  input = head_read(b);
+  for (uint64_t m = b->states; m != 0; m &= m - 1) {
+    q = __builtin_ctzll(m);
+    s = &tm->states[q];
+    tr_in = tm_find_tr_input(tm, s, input);
+    tr = tr_in == NULL ? NULL : tr_in->transitions;
+    if (tr == NULL) { /* This state halts */
+      if (s->tr_inputs_count == 0 && s->is_acc) {
+        return true;
+      }
+      continue;
+    }
+    for (; tr != NULL; tr = tr->next) {
+      for (g = 0; g < count && (groups[g].tr->output != tr->output ||
+                                groups[g].tr->move != tr->move); g++);
+      if (g == count) {
+        groups[count].tr = tr;
+        groups[count++].states = 0;
+      }
+      groups[g].states |= (uint64_t) 1 << tr->state;
+    }
+  }
+  b->states = 0;
+  if (count == 0 || b->steps >= b->loop_at) { /* Halted, or looping */
+    return false;
+  }
+
+  /* One branch per group, the first one goes on on this branch */
+  b->tr = groups[0].tr;
+  b->states = groups[0].states;
+  rq_enqueue(tm, b);
+  for (g = 1; g < count; g++) {
+    branch_t * child = branch_clone(b, groups[g].tr);
+    child->states = groups[g].states;
+    rq_enqueue(tm, child);
+  }
+  return false;
+}
+
+/** Keeps the states of a branch which could still halt in an acceptance
+  * state within the remaining steps, as branch_can_accept does.
+  * Returns true if some is left.
+  */
+bool branch_sets_can_accept(tm_t * tm, branch_t * b) {
+  long int left = tm->max_steps - b->steps;
+  uint64_t kept = 0;
+  int q;
+
+  for (uint64_t m = b->states; m != 0; m &= m - 1) {
+    q = __builtin_ctzll(m);
+    /* The pending transition, if any, takes one step */
+    if (b->tr == NULL ? tm->states[q].acc_dist <= left :
+                        tm->states[q].acc_dist < left) {
+      kept |= (uint64_t) 1 << q;
+    }
+  }
+  b->states = kept;
+  return kept != 0;
+}
+
+/** Tells if some state forks, on some symbol, into transitions writing
+  * the same symbol and moving the same way. Otherwise each set holds a
+  * single state all along, and tm_compute_rq runs the machine faster.
+  */
+bool tm_forks_merge(const tm_t * tm) {
+  tr_output_t * tr, * other;
+  state_t * s;
+
+  for (int q = 0; q <= tm->max_state; q++) {
+    s = &tm->states[q];
+    for (int j = 0; j < s->tr_inputs_count; j++) {
+      for (tr = s->tr_inputs[j].transitions; tr != NULL; tr = tr->next) {
+        for (other = tr->next; other != NULL; other = other->next) {
+          if (other->output == tr->output && other->move == tr->move) {
+            return true;
+          }
+        }
+      }
+    }
+  }
+  return false;
+}
+
+/** Bounds the groups of tm_step_set: they are at most the transitions
+  * on the symbol read, and at most one per symbol ID and move character.
+  */
+int tm_set_groups(const tm_t * tm) {
+  long int count[256] = {0}, most = 0, moves = 0;
+  bool seen[256] = {false};
+  tr_output_t * tr;
+  state_t * s;
+
+  for (int q = 0; q <= tm->max_state; q++) {
+    s = &tm->states[q];
+    for (int j = 0; j < s->tr_inputs_count; j++) {
+      for (tr = s->tr_inputs[j].transitions; tr != NULL; tr = tr->next) {
+        count[(unsigned char) s->tr_inputs[j].input]++;
+        moves += !seen[(unsigned char) tr->move];
+        seen[(unsigned char) tr->move] = true;
+      }
+    }
+  }
+  for (int id = 0; id < 256; id++) {
+    most = count[id] > most ? count[id] : most;
+  }
+  return (int) (most < tm->alpha.size * moves ? most : tm->alpha.size * moves);
+}
+
+/** Runs the only branch of a deterministic machine, without the runqueue,
+  * and destroys it. The loop is the one of tm_compute_rq for a runqueue
+  * of one branch, specialized on the tape backend: each known backend
+  * gets its own copy, calling its tape functions directly.
+  * Return code: 0: refuse, 1: accept, U: undetermined
+  */
+char tm_compute_alone(tm_t * tm, branch_t * b) {
+  const tape_ops_t * ops = b->tape->ops; /* A flat tape may be a paged one */
+
+  if (ops == &paged_tape) {
+    return tm_compute_with(tm, b, &paged_tape);
+  } else if (ops == &packed_tape) {
+    return tm_compute_with(tm, b, &packed_tape);
+  } else if (ops == &rle_tape) {
+    return tm_compute_with(tm, b, &rle_tape);
+  } else if (ops == &flat_tape) {
+    return tm_compute_with(tm, b, &flat_tape);
+  } else if (ops == &mapped_tape) {
+    return tm_compute_with(tm, b, &mapped_tape);
+  }
+  return tm_compute_with(tm, b, ops);
+}
+
+/** Body of tm_compute_alone, inlined with a constant backend, so that the
+  * compiler can resolve the calls through ops.
+  */
+char tm_compute_with(tm_t * tm, branch_t * b, const tape_ops_t * ops) {
+  tr_input_t * tr_in;
+  state_t * s;
+  char c;
+
+  while (true) {
+    if (tm->mem_cap > 0 && mem_held - tm->mem_base > tm->mem_limit &&
+        tm_reduce_memory(tm)) {
+      c = SYM_UNDET;
+      break;
+    }
+    if (b->steps == tm->max_steps) { /* Preempted */
+      c = SYM_UNDET;
+      break;
+    }
+    if (b->tr != NULL && tm->work++ == tm->next_check &&
+        tm_check_limits(tm, b->steps)) {
+      c = SYM_UNDET;
+      break;
+    }
+    if ((b->steps & (TRIM_PERIOD - 1)) == 0 && ops->trim != NULL &&
+        b->tape->ref_count == 1) {
+      ops->trim(b, tm->max_steps - b->steps);
+    }
+    LOG_STATUS(tm, b);
+    LOG_TAPE(b);
+
+    /* Execute the transition, as tm_step does */
+    if (b->tr != NULL) {
+      b->state = &tm->states[b->tr->state];
+      ops->write(b, b->tr->output);
+      ops->move(b, b->tr->move);
+      b->steps++;
+      if (tm->loop_cells > 0) {
+        branch_track(tm, b, b->tr->move);
+      }
+    }
+    s = b->state;
+    tr_in = tm_find_tr_input(tm, s, ops->read(b));
+    b->tr = tr_in == NULL ? NULL : tr_in->transitions;
+    if (b->tr == NULL) { /* Halted */
+      c = s->tr_inputs_count == 0 && s->is_acc ? SYM_ACCEPT : SYM_REFUSE;
+      break;
+    }
+    if (b->steps >= b->loop_at) { /* Looping */
+      c = SYM_REFUSE;
+      break;
+    }
+  }
+  branch_destroy(b);
+  return c;
+}
+
+/** Checks the deadline and the step budget of the current input,
+  * and sets when to check them again: every LIMIT_PERIOD steps,
+  * or exactly when the budget runs out.
+  * Progress reports, asked or periodic, are printed here too:
+  * depth is the steps of the branch about to step.
+  * Returns true if the run must stop, tm->limit tells why.
+  */
+bool tm_check_limits(tm_t * tm, long int depth) {
+  struct timespec now;
+  long int elapsed_ms;
+
+  if (tm->step_budget > 0 && tm->work > tm->step_budget) {
+    tm->limit = "step budget";
+    return true;
+  }
+  if (tm->deadline_ms > 0 || tm->progress_ms > 0 ||
+      tm->progress_seen != progress_requests) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_ms = (now.tv_sec - tm->started.tv_sec) * 1000 +
+                 (now.tv_nsec - tm->started.tv_nsec) / 1000000;
+    if (tm->deadline_ms > 0 && elapsed_ms >= tm->deadline_ms) {
+      tm->limit = "deadline";
+      return true;
+    }
+    if (tm->progress_seen != progress_requests ||
+        (tm->progress_ms > 0 && elapsed_ms >= tm->progress_due)) {
+      tm_progress(tm, depth, elapsed_ms);
+    }
+  }
+
+  tm->next_check = tm->work + LIMIT_PERIOD - 1;
+  if (tm->step_budget > 0 && tm->next_check > tm->step_budget) {
+    tm->next_check = tm->step_budget;
+  }
+  /* Exchange branches with the other workers, if any */
+  return tm->explore != NULL && explore_sync(tm);
+}
+
+/** Prints a snapshot of the current input on stderr, without stopping it:
+  * the depth of the BFS, the runqueue, the steps done,
+  * overall and since the previous report, and the thread's counters.
+  * Then sets when the next periodic report is due.
+  */
+void tm_progress(tm_t * tm, long int depth, long int elapsed_ms) {
+  long int ms = elapsed_ms - tm->report_ms;
+
+  tm->progress_seen = progress_requests;
+  fprintf(stderr, "Progress: input %ld, %.1fs, depth %ld, runqueue %ld, "
+    "%ld steps (%.0f/s, %.0f/s now), branches %ld created %ld destroyed, "
+    "%ld live pages, %.1fMB copied by COW\n",
+    tm->inputs, elapsed_ms / 1000.0, depth, tm->rq_len, tm->work,
+    elapsed_ms > 0 ? tm->work * 1000.0 / elapsed_ms : 0.0,
+    ms > 0 ? (tm->work - tm->report_work) * 1000.0 / ms : 0.0,
+    counters.branches_created, counters.branches_destroyed, counters.pages,
+    counters.cow_bytes / (1024.0 * 1024.0));
+  tm->report_work = tm->work;
+  tm->report_ms = elapsed_ms;
+  if (tm->progress_ms > 0) {
+    while (tm->progress_due <= elapsed_ms) {
+      tm->progress_due += tm->progress_ms;
+    }
+  }
+}
+
+/* Handler of SIGUSR1: asks every running input for a progress report */
+void progress_signal(int sig) {
+  (void) sig;
+  progress_requests++;
+}
+
+/** Called when the current input holds more memory than its limit.
+  * At 3/4 of the cap, it switches to a depth-first execution, so that the
+  * runqueue stops growing, and packs the tapes of all the queued branches.
+  * Returns true if the run must stop, that is if the cap is exceeded.
+  */
+bool tm_reduce_memory(tm_t * tm) {
+  if (!tm->degraded) {
+    LOG("INFO: Near the memory cap, going depth-first\n");
+    tm->degraded = true;
+    tm->mem_limit = tm->mem_cap;
+    for (branch_t * b = tm->rq_head; b != NULL; b = b->next) {
+      if (b->tape->packed == NULL && b->tape->ref_count == 1 &&
+          b->tape->ops->pack != NULL) {
+        b->tape->ops->pack(b);
+      }
+    }
+    if (mem_held - tm->mem_base <= tm->mem_cap) {
+      return false;
+    }
+  }
+  tm->limit = "memory cap";
+  return true;
+}
+
+/** Takes in a branch from the queue.
+  * Then executes the given transition, if any.
+  * Looks for the next transition, if it find none it returns the halt state,
+  * else it returns NULL.
+  * Re-enqueues the branch(es) with the next transition(s).
+  */
+state_t * tm_step(tm_t * tm, branch_t * b) {
+  branch_t * b_child;
+  state_t * s = NULL;
+  tr_output_t * tr_next;
+  tr_input_t * tr_in;
+  char input;
+
+  /* Execute given transition */
+  if (b->tr != NULL) {
+    LOG("DEBUG: Doing transition -> %d, %c, %c\n", b->tr->state,
+      tm->alpha.sym[(unsigned char) b->tr->output], b->tr->move);
+    s = &tm->states[b->tr->state]; /* Save next state */
+
+    /* Complete the transition */
+    b->state = s;
+    head_write(b, b->tr->output);
+    head_move(b, b->tr->move);
+    b->steps++;
+    if (tm->loop_cells > 0) {
+      branch_track(tm, b, b->tr->move);
+    }
+  }
+
+  /* Look for the next transition(s) */
+  s = b->state; /* Save current state */
+  input = head_read(b); /* Read input */
+  tr_in = tm_find_tr_input(tm, s, input);
+  tr_next = tr_in == NULL ? NULL : tr_in->transitions;
+
+  if (tr_next == NULL) { /* Machine needs to halt */
+    LOG("DEBUG: Reached halt state\n");
+    return s; /* Returns the halt state */
+  }
+  if (b->steps >= b->loop_at) { /* Looping, it can't accept: a dead branch */
+    LOG("DEBUG: Dropping looping branch\n");
+    return s;
+  }
+
+  /* Set the first transition as the next on this branch */
+  b->tr = tr_next;
+  rq_enqueue(tm, b);
+
+  /** If there are other (non-deterministic) transitions, they are
+    * pushed on top of the first one, so they will be executed first
+    * and copy the memory of their parent at the moment of branching.
+    * In this way we don't waste the parent's memory.
+    */
+  tr_next = tr_next->next;
+  while (tr_next != NULL) {
+    b_child = branch_clone(b, tr_next); /* Clone with shared memory */
+    rq_enqueue(tm, b_child);
+    tr_next = tr_next->next;
+  }
+
+  return NULL; /* Next branch in the runqueue will be executed */
+}
+
+/* Read the char in the cell under head */
+char head_read(branch_t * b) {
+  return b->tape->ops->read(b);
+}
+
+/* Write given char in the cell under the head */
+void head_write(branch_t * b, char c) {
+  b->tape->ops->write(b, c);
+}
+
+/* Move the head L, S, R */
+void head_move(branch_t * b, char move) {
+  b->tape->ops->move(b, move);
+}
+
+/** Read the char in the cell under head, even if no page is allocated.
+  * NOTE: Assuming that if the head is set, it is in a valid position
+  */
+char tape_read(branch_t * b) {
+  /* First check if the cell is materialized */
+  if (b->head_page == NULL) {
+    return BLANK_ID; /* Do not waste time+space allocating memory */
+  } else {
+    return b->head_page->mem[b->head_pos];
+  }
+}
+
+/** Write given char in the cell under the head.
+  * Pages are only materialized when a non-blank char is written,
+  * and the tape and the page are made private if needed (copy-on-write)
+  */
+void tape_write(branch_t * b, char c) {
+  if (b->head_page == NULL) {
+    if (c == BLANK_ID) { /* Writing a blank on a virtual cell changes nothing */
+      return;
+    }
+  } else if (b->head_page->mem[b->head_pos] == c) { /* Only write if different */
+    return;
+  }
+
+  if (b->tape->ref_count > 1) { /* If the tape is shared, make it private */
+    tape_make_private(b);
+  }
+  if (b->head_page == NULL) { /* Page fault */
+    tape_materialize(b);
+  }
+  if (b->head_page->interned) { /* The page may be shared */
+    head_page_make_private(b);
+  }
+  /* Now write the char */
+  b->head_page->mem[b->head_pos] = c;
+}
+
+/** Move the head L, S, R.
+  * Walking off the materialized region doesn't allocate anything:
+  * the head keeps its absolute position and reads blanks from there.
+  */
+void tape_move(branch_t * b, char move) {
+  if (move == 'R') {
+    if (b->head_pos < PAGE_SIZE - 1) { /* Just increment the position */
+      b->head_pos++;
+      return;
+    }
+    /* Move to next page */
+    b->head_pos = 0;
+    b->head_pnum++;
+  } else if (move == 'L') {
+    if (b->head_pos > 0) { /* Just decrement the position */
+      b->head_pos--;
+      return;
+    }
+    /* Move to previous page */
+    b->head_pos = PAGE_SIZE - 1;
+    b->head_pnum--;
+  } else {
+    return;
+  }
+
+  /* Look up the new page, NULL outside of the materialized region */
+  b->head_page = tape_page_at(b->tape, b->head_pnum);
+}
+
+/* Put the head on an absolute cell */
+void tape_seek(branch_t * b, long int cell) {
+  b->head_pnum = cell_page(cell, PAGE_SIZE);
+  b->head_pos = (int) (cell - b->head_pnum * PAGE_SIZE);
+  b->head_page = tape_page_at(b->tape, b->head_pnum);
+}
+
+/* Debug print of the materialized region, '!' follows the head */
+void tape_print(branch_t * b) {
+  tape_t * t = b->tape;
+  for (int j = 0; j < t->page_count; j++) {
+    for (int i = 0; i < PAGE_SIZE; i++) {
+      printf("%c", t->alpha->sym[(unsigned char) t->pages[j]->mem[i]]);
+      if (t->pages[j] == b->head_page && i == b->head_pos) {
+        printf("!");
+      }
+    }
+  }
+  if (b->head_page == NULL) {
+    printf(" (head on blank cell %ld)", b->head_pnum * PAGE_SIZE + b->head_pos);
+  }
+}
+
+/**
+  * BIT-PACKED TAPES
+  * Paged tapes whose cells hold the code of their symbol, in 1, 2 or 4 bits.
+  * Pages are shared, trimmed and packed just like the byte ones.
+  */
+
+/* Returns the code of a cell in a bit-packed page */
+int packed_get(const alphabet_t * a, page_t * p, int pos) {
+  int shift = (pos & ((1 << a->cell_shift) - 1)) * a->bits;
+  return ((unsigned char) p->mem[pos >> a->cell_shift] >> shift) &
+         ((1 << a->bits) - 1);
+}
+
+/* Read the char in the cell under the head */
+char packed_read(branch_t * b) {
+  if (b->head_page == NULL) {
+    return BLANK_ID;
+  }
+  return (char) packed_get(b->tape->alpha, b->head_page, b->head_pos);
+}
+
+/* Write given char in the cell under the head, see tape_write */
+void packed_write(branch_t * b, char c) {
+  const alphabet_t * a = b->tape->alpha;
+  int code = (unsigned char) c, shift;
+  char * byte;
+
+  if (b->head_page == NULL) {
+    if (code == 0) { /* Writing a blank on a virtual cell changes nothing */
+      return;
+    }
+  } else if (packed_get(a, b->head_page, b->head_pos) == code) {
+    return;
+  }
+
+  if (b->tape->ref_count > 1) { /* If the tape is shared, make it private */
+    tape_make_private(b);
+  }
+  if (b->head_page == NULL) { /* Page fault */
+    tape_materialize(b);
+  }
+  if (b->head_page->interned) { /* The page may be shared */
+    head_page_make_private(b);
+  }
+  /* Now write the code */
+  byte = &b->head_page->mem[b->head_pos >> a->cell_shift];
+  shift = (b->head_pos & ((1 << a->cell_shift) - 1)) * a->bits;
+  *byte = (char) (((unsigned char) *byte & ~(((1 << a->bits) - 1) << shift)) |
+                  code << shift);
+}
+
+/* Move the head L, S, R, see tape_move */
+void packed_move(branch_t * b, char move) {
+  if (move == 'R') {
+    if (b->head_pos < b->tape->alpha->cpp - 1) {
+      b->head_pos++;
+      return;
+    }
+    b->head_pos = 0;
+    b->head_pnum++;
+  } else if (move == 'L') {
+    if (b->head_pos > 0) {
+      b->head_pos--;
+      return;
+    }
+    b->head_pos = b->tape->alpha->cpp - 1;
+    b->head_pnum--;
+  } else {
+    return;
+  }
+  b->head_page = tape_page_at(b->tape, b->head_pnum);
+}
+
+/* Put the head on an absolute cell */
+void packed_seek(branch_t * b, long int cell) {
+  long int cpp = b->tape->alpha->cpp;
+  b->head_pnum = cell_page(cell, cpp);
+  b->head_pos = (int) (cell - b->head_pnum * cpp);
+  b->head_page = tape_page_at(b->tape, b->head_pnum);
+}
+
+/* Debug print of the materialized region, '!' follows the head */
+void packed_print(branch_t * b) {
+  tape_t * t = b->tape;
+  for (int j = 0; j < t->page_count; j++) {
+    for (int i = 0; i < t->alpha->cpp; i++) {
+      printf("%c", t->alpha->sym[packed_get(t->alpha, t->pages[j], i)]);
+      if (t->pages[j] == b->head_page && i == b->head_pos) {
+        printf("!");
+      }
+    }
+  }
+  if (b->head_page == NULL) {
+    printf(" (head on blank cell %ld)",
+      b->head_pnum * t->alpha->cpp + b->head_pos);
+  }
+}
+
+/**
+  * RUN-LENGTH TAPES
+  * The materialized region is a sequence of (symbol, length) runs,
+  * the head is the run index and the offset in it.
+  */
+
+/* Read the char in the cell under the head */
+char rle_read(branch_t * b) {
+  tape_t * t = b->tape;
+  if ((unsigned int) b->head_run < (unsigned int) t->run_count) {
+    return t->runs[b->head_run].sym;
+  }
+  return BLANK_ID;
+}
+
+/** Write given char in the cell under the head, splitting its run and
+  * merging it with the adjacent ones if they have the same symbol.
+  */
+void rle_write(branch_t * b, char c) {
+  tape_t * t;
+  run_t * r;
+  int i;
+
+  if (rle_read(b) == c) { /* Only write if different */
+    return;
+  }
+  if (b->tape->ref_count > 1) { /* If the tape is shared, make it private */
+    rle_make_private(b);
+  }
+  t = b->tape;
+  if ((unsigned int) b->head_run >= (unsigned int) t->run_count) {
+    rle_extend(b); /* The head is now on a blank run */
+  }
+
+  i = b->head_run;
+  r = &t->runs[i];
+  if (r->len == 1) { /* Just change the symbol, then merge */
+    r->sym = c;
+    if (i + 1 < t->run_count && t->runs[i + 1].sym == c) {
+      r->len += t->runs[i + 1].len;
+      rle_remove(t, i + 1);
+    }
+    if (i > 0 && t->runs[i - 1].sym == c) {
+      b->head_run = i - 1;
+      b->head_off = t->runs[i - 1].len;
+      t->runs[i - 1].len += t->runs[i].len;
+      rle_remove(t, i);
+    }
+  } else if (b->head_off == 0) { /* First cell of the run */
+    if (i > 0 && t->runs[i - 1].sym == c) { /* Grow the previous run */
+      r->len--;
+      b->head_run = i - 1;
+      b->head_off = t->runs[i - 1].len++;
+    } else {
+      rle_insert(t, i, 1);
+      t->runs[i].sym = c;
+      t->runs[i].len = 1;
+      t->runs[i + 1].len--;
+    }
+  } else if (b->head_off == r->len - 1) { /* Last cell of the run */
+    r->len--;
+    b->head_run = i + 1;
+    b->head_off = 0;
+    if (i + 1 < t->run_count && t->runs[i + 1].sym == c) { /* Grow the next */
+      t->runs[i + 1].len++;
+    } else {
+      rle_insert(t, i + 1, 1);
+      t->runs[i + 1].sym = c;
+      t->runs[i + 1].len = 1;
+    }
+  } else { /* Split the run in three */
+    rle_insert(t, i + 1, 2);
+    r = &t->runs[i];
+    t->runs[i + 1].sym = c;
+    t->runs[i + 1].len = 1;
+    t->runs[i + 2].sym = r->sym;
+    t->runs[i + 2].len = r->len - b->head_off - 1;
+    r->len = b->head_off;
+    b->head_run = i + 1;
+    b->head_off = 0;
+  }
+}
+
+/* Move the head L, S, R, in O(1) within a run */
+void rle_move(branch_t * b, char move) {
+  tape_t * t = b->tape;
+
+  if (move == 'R') {
+    b->head_cell++;
+    if ((unsigned int) b->head_run < (unsigned int) t->run_count) {
+      if (++b->head_off < t->runs[b->head_run].len) {
+        return;
+      }
+      b->head_run++; /* Next run, or past the last one */
+      b->head_off = 0;
+    } else if (b->head_run < 0 && b->head_cell == t->first_cell) {
+      b->head_run = 0; /* Back from the left */
+      b->head_off = 0;
+    }
+  } else if (move == 'L') {
+    b->head_cell--;
+    if ((unsigned int) b->head_run < (unsigned int) t->run_count) {
+      if (b->head_off > 0) {
+        b->head_off--;
+        return;
+      }
+      b->head_run--; /* Previous run, or before the first one */
+      if (b->head_run >= 0) {
+        b->head_off = t->runs[b->head_run].len - 1;
+      }
+    } else if (b->head_run > 0 &&
+               b->head_cell == t->first_cell + t->cell_count - 1) {
+      b->head_run = t->run_count - 1; /* Back from the right */
+      b->head_off = t->runs[b->head_run].len - 1;
+    }
+  }
+}
+
+/* Put the head on an absolute cell */
+void rle_seek(branch_t * b, long int cell) {
+  tape_t * t = b->tape;
+  long int off = cell - t->first_cell;
+
+  b->head_cell = cell;
+  b->head_off = 0;
+  if (t->run_count == 0 || off >= t->cell_count) {
+    b->head_run = t->run_count;
+  } else if (off < 0) {
+    b->head_run = -1;
+  } else {
+    b->head_run = 0;
+    while (off >= t->runs[b->head_run].len) {
+      off -= t->runs[b->head_run].len;
+      b->head_run++;
+    }
+    b->head_off = off;
+  }
+}
+
+/* Debug print of the runs, '!' follows the head run */
+void rle_print(branch_t * b) {
+  tape_t * t = b->tape;
+  for (int i = 0; i < t->run_count; i++) {
+    printf("%c*%ld%s ", t->alpha->sym[(unsigned char) t->runs[i].sym],
+      t->runs[i].len,
+      i == b->head_run ? "!" : "");
+  }
+  printf("(head on cell %ld)", b->head_cell);
+}
+
+/* Deallocates an unreferenced tape */
+void rle_destroy(tape_t * t) {
+  free(t->runs);
+  free(t->packed);
+  mem_held -= sizeof(tape_t) + t->run_cap * sizeof(run_t);
+  free(t);
+}
+
+/* Makes a private copy of the runs, in a copy-on-write fashion */
+void rle_make_private(branch_t * b) {
+  tape_t * parent = b->tape;
+  tape_t * t = tape_create(parent->ops);
+
+  t->alpha = parent->alpha;
+  t->settled = parent->settled;
+  t->first_cell = parent->first_cell;
+  t->cell_count = parent->cell_count;
+  t->run_count = parent->run_count;
+  t->run_cap = parent->run_count + 2; /* Room for a split */
+  t->runs = (run_t *) malloc(t->run_cap * sizeof(run_t));
+  mem_held += t->run_cap * sizeof(run_t);
+  memcpy(t->runs, parent->runs, t->run_count * sizeof(run_t));
+  counters.cow_bytes += t->run_count * sizeof(run_t);
+  parent->ref_count--;
+  b->tape = t;
+}
+
+/** Extends the region up to the head with a blank run,
+  * so that the head cell can be written.
+  * NOTE: the tape must be private
+  */
+void rle_extend(branch_t * b) {
+  tape_t * t = b->tape;
+  long int gap;
+
+  if (t->run_count == 0) { /* Empty tape, the region starts at the head */
+    t->first_cell = b->head_cell;
+    t->cell_count = 0;
+  }
+
+  if (b->head_cell < t->first_cell) { /* Extend the region on the left */
+    gap = t->first_cell - b->head_cell;
+    if (t->runs[0].sym != BLANK_ID) {
+      rle_insert(t, 0, 1);
+      t->runs[0].sym = BLANK_ID;
+      t->runs[0].len = 0;
+    }
+    t->runs[0].len += gap;
+    t->first_cell -= gap;
+    b->head_run = 0;
+    b->head_off = 0;
+  } else { /* Extend the region on the right */
+    gap = b->head_cell - t->first_cell - t->cell_count + 1;
+    if (t->run_count == 0 || t->runs[t->run_count - 1].sym != BLANK_ID) {
+      rle_insert(t, t->run_count, 1);
+      t->runs[t->run_count - 1].sym = BLANK_ID;
+      t->runs[t->run_count - 1].len = 0;
+    }
+    t->runs[t->run_count - 1].len += gap;
+    b->head_run = t->run_count - 1;
+    b->head_off = t->runs[b->head_run].len - 1;
+  }
+  t->cell_count += gap;
+}
+
+/* Inserts n uninitialised runs before runs[i] */
+void rle_insert(tape_t * t, int i, int n) {
+  if (t->run_count + n > t->run_cap) {
+    mem_held += ((t->run_count + n) * 2 - t->run_cap) * sizeof(run_t);
+    t->run_cap = (t->run_count + n) * 2;
+    t->runs = (run_t *) realloc(t->runs, t->run_cap * sizeof(run_t));
+  }
+  memmove(&t->runs[i + n], &t->runs[i], (t->run_count - i) * sizeof(run_t));
+  t->run_count += n;
+}
+
+/* Removes runs[i] */
+void rle_remove(tape_t * t, int i) {
+  t->run_count--;
+  memmove(&t->runs[i], &t->runs[i + 1], (t->run_count - i) * sizeof(run_t));
+}
+
+/* Inserts a branch at the end of the runqueue, on top when depth-first */
+void rq_enqueue(tm_t * tm, branch_t * b) {
+  b->next = NULL;
+  tm->rq_len++;
+  if (tm->degraded && tm->rq_head != NULL) { /* Depth-first, push on top */
+    b->next = tm->rq_head;
+    tm->rq_head = b;
+  } else if (tm->rq_tail != NULL) { /* The queue is non-empty */
+    tm->rq_tail->next = b;
+    tm->rq_tail = b;
+  } else { /* The queue is empty */
+    tm->rq_head = b;
+    tm->rq_tail = b;
+  }
+}
+
+/* Removes a branch from the head of the runqueue and returns it */
+branch_t * rq_dequeue(tm_t * tm) {
+  branch_t * b;
+  if (tm->rq_head != NULL) {
+    b = tm->rq_head;
+    tm->rq_head = b->next;
+    tm->rq_len--;
+    if(tm->rq_head == NULL) {
+      tm->rq_tail = NULL;
+    }
+    return b;
+  } else {
+    return NULL;
+  }
+}
+
+/**
+  * FLAT TAPES
+  * The tape is one contiguous range of virtual memory, reserved with mmap
+  * and filled with zero pages by the kernel when first touched: BLANK_ID is
+  * 0, so untouched cells read as blanks. The head is a pointer to its cell.
+  * A branch is preempted after max_steps steps, so its head never gets
+  * farther than that from the cells of the input: the range covers all of
+  * them, and moving the head needs no bounds check and never allocates.
+  * The guard pages at both ends only catch a head gone astray.
+  * Each tape is a mapping of its own, and the process can only have so
+  * many (vm.max_map_count), malloc failing too once they are all taken:
+  * past FLAT_MAX_TAPES, new tapes are paged ones.
+  */
+
+/* Read the char in the cell under the head */
+char flat_read(branch_t * b) {
+  return *b->head_ptr;
+}
+
+/* Write given char in the cell under the head, copying a shared tape */
+void flat_write(branch_t * b, char c) {
+  long int cell;
+
+  if (*b->head_ptr == c) { /* Only write if different */
+    return;
+  }
+  if (b->tape->ref_count > 1) {
+    flat_make_private(b);
+    if (b->tape->ops != &flat_tape) { /* The copy is a paged tape */
+      b->tape->ops->write(b, c);
+      return;
+    }
+  }
+  *b->head_ptr = c;
+  cell = b->head_ptr - b->tape->cells;
+  if (cell < b->tape->lo || cell > b->tape->hi) {
+    flat_extend(b->tape, cell);
+  }
+}
+
+/* Move the head L, S, R */
+void flat_move(branch_t * b, char move) {
+  b->head_ptr += (move == 'R') - (move == 'L');
+}
+
+/* Put the head on an absolute cell */
+void flat_seek(branch_t * b, long int cell) {
+  b->head_ptr = b->tape->cells + cell;
+}
+
+/* Debug print of the written cells, '!' follows the head */
+void flat_print(branch_t * b) {
+  tape_t * t = b->tape;
+  for (long int i = t->lo; i <= t->hi; i++) {
+    printf("%c%s", t->alpha->sym[(unsigned char) t->cells[i]],
+      t->cells + i == b->head_ptr ? "!" : "");
+  }
+  printf(" (head on cell %ld)", (long int) (b->head_ptr - t->cells));
+}
+
+/* Deallocates an unreferenced tape */
+void flat_destroy(tape_t * t) {
+  munmap(t->map, t->map_len);
+  __atomic_sub_fetch(&flat_tapes, 1, __ATOMIC_RELAXED);
+  mem_held -= sizeof(tape_t) + (t->lo <= t->hi ? t->hi - t->lo + 1 : 0);
+  free(t);
+}
+
+/** Reserves the range of a new tape: an input is at most max_steps + 1
+  * cells long, and the head moves at most max_steps cells away from it.
+  * Returns false if it cannot be mapped.
+  */
+bool flat_reserve(tape_t * t, long int max_steps) {
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  size_t side = ((size_t) max_steps + 1 + page - 1) / page * page;
+
+  return flat_map(t, page + side + side * 2 + page, page + side);
+}
+
+/** Maps len bytes of zero pages, with cell 0 at the given offset,
+  * and protects the first and the last page as guards.
+  * Returns false, leaving the tape untouched, if it cannot be mapped or
+  * if FLAT_MAX_TAPES are already.
+  */
+bool flat_map(tape_t * t, size_t len, size_t offset) {
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  char * map = MAP_FAILED;
+
+  if (__atomic_add_fetch(&flat_tapes, 1, __ATOMIC_RELAXED) <= FLAT_MAX_TAPES) {
+    map = (char *) mmap(NULL, len, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+  if (map == MAP_FAILED) {
+    __atomic_sub_fetch(&flat_tapes, 1, __ATOMIC_RELAXED);
+    LOG("DEBUG: Cannot map %zu bytes for a flat tape\n", len);
+    return false;
+  }
+  t->map = map;
+  mprotect(t->map, page, PROT_NONE);
+  mprotect(t->map + len - page, page, PROT_NONE);
+  t->map_len = len;
+  t->cells = t->map + offset;
+  t->lo = 1;
+  t->hi = 0;
+  return true;
+}
+
+/** Makes a private copy of the written cells, in a copy-on-write fashion.
+  * If no mapping is left for it, the copy is a paged tape.
+  */
+void flat_make_private(branch_t * b) {
+  tape_t * parent = b->tape;
+  tape_t * t = tape_create(parent->ops);
+
+  t->alpha = parent->alpha;
+  t->settled = parent->settled;
+  if (!flat_map(t, parent->map_len, parent->cells - parent->map)) {
+    t->ops = &paged_tape;
+    b->tape = t;
+    flat_copy_paged(b, parent);
+    parent->ref_count--;
+    return;
+  }
+  if (parent->lo <= parent->hi) {
+    flat_extend(t, parent->lo);
+    flat_extend(t, parent->hi);
+    memcpy(t->cells + t->lo, parent->cells + t->lo, t->hi - t->lo + 1);
+    counters.cow_bytes += t->hi - t->lo + 1;
+  }
+  b->head_ptr = t->cells + (b->head_ptr - parent->cells);
+  parent->ref_count--;
+  b->tape = t;
+}
+
+/* Writes the cells of a flat tape on the empty paged tape of a branch */
+void flat_copy_paged(branch_t * b, tape_t * parent) {
+  long int head = b->head_ptr - parent->cells;
+
+  tape_seek(b, parent->lo);
+  for (long int i = parent->lo; i <= parent->hi; i++) {
+    tape_write(b, parent->cells[i]);
+    tape_move(b, 'R');
+  }
+  counters.cow_bytes += parent->lo <= parent->hi ?
+                        parent->hi - parent->lo + 1 : 0;
+  tape_seek(b, head);
+}
+
+/* Extends the written cells up to a cell, accounting for their memory */
+void flat_extend(tape_t * t, long int cell) {
+  long int before = t->lo <= t->hi ? t->hi - t->lo + 1 : 0;
+
+  if (t->lo > t->hi) {
+    t->lo = cell;
+    t->hi = cell;
+  } else if (cell < t->lo) {
+    t->lo = cell;
+  } else if (cell > t->hi) {
+    t->hi = cell;
+  }
+  mem_held += t->hi - t->lo + 1 - before;
+}
+
+/**
+  * MAPPED TAPES
+  * Paged tapes whose input is not copied: the input file is mapped
+  * read-only, once per run, and the cells nobody wrote are read from the
+  * line in it, through the symbol IDs. The slots of the input pages hold
+  * store.input until a cell is written, then the page is copied out of the
+  * input, so a long input costs nothing before the machine touches it.
+  * Everything else is done as on paged tapes.
+  */
+
+/* Read the char in the cell under the head, from the input if not written */
+char mapped_read(branch_t * b) {
+  page_t * p = b->head_page;
+  tape_t * t = b->tape;
+  unsigned long int cell;
+
+  if (p != NULL && p != store.input) {
+    return p->mem[b->head_pos];
+  }
+  cell = (unsigned long int) (b->head_pnum * PAGE_SIZE + b->head_pos);
+  if (cell < (unsigned long int) t->source_len) {
+    return (char) t->alpha->code[(unsigned char) t->source[cell]];
+  }
+  return BLANK_ID;
+}
+
+/** Write given char in the cell under the head, as tape_write does.
+  * An input page is copied out of the input before its first write.
+  */
+void mapped_write(branch_t * b, char c) {
+  if (mapped_read(b) == c) { /* Only write if different */
+    return;
+  }
+  if (b->tape->ref_count > 1) { /* If the tape is shared, make it private */
+    tape_make_private(b);
+  }
+  if (b->head_page == NULL) { /* Page fault */
+    tape_materialize(b);
+  }
+  if (b->head_page == store.input) { /* Still on the input */
+    mapped_make_private(b);
+  } else if (b->head_page->interned) { /* The page may be shared */
+    head_page_make_private(b);
+  }
+  b->head_page->mem[b->head_pos] = c;
+}
+
+/* Debug print of the materialized region, '!' follows the head */
+void mapped_print(branch_t * b) {
+  tape_t * t = b->tape;
+  long int cell;
+  char c;
+
+  for (int j = 0; j < t->page_count; j++) {
+    for (int i = 0; i < PAGE_SIZE; i++) {
+      cell = (t->first_pnum + j) * PAGE_SIZE + i;
+      c = t->pages[j] != store.input ? t->pages[j]->mem[i] :
+          cell < t->source_len ? (char) t->alpha->code[
+                                   (unsigned char) t->source[cell]] :
+                                 BLANK_ID;
+      printf("%c", t->alpha->sym[(unsigned char) c]);
+      if (t->first_pnum + j == b->head_pnum && i == b->head_pos) {
+        printf("!");
+      }
+    }
+  }
+  if (b->head_page == NULL) {
+    printf(" (head on cell %ld)", b->head_pnum * PAGE_SIZE + b->head_pos);
+  }
+}
+
+/** Replaces the input page under the head with a private page holding
+  * the IDs of its cells.
+  * NOTE: the tape must be private
+  */
+void mapped_make_private(branch_t * b) {
+  tape_t * t = b->tape;
+  page_t * p = page_create(NULL);
+  long int first = b->head_pnum * PAGE_SIZE;
+  long int n = t->source_len - first < PAGE_SIZE ? t->source_len - first :
+                                                   PAGE_SIZE;
+
+  LOG("DEBUG: Copying input page\n");
+  for (long int i = 0; i < n; i++) {
+    p->mem[i] = (char) t->alpha->code[(unsigned char) t->source[first + i]];
+  }
+  counters.cow_bytes += PAGE_SIZE;
+  t->pages[b->head_pnum - t->first_pnum] = p;
+  page_release(b->head_page);
+  b->head_page = p;
+}
+
+/* Puts the len cells of an input on the empty tape of a root branch */
+void mapped_attach(tm_t * tm, branch_t * b, const char * source,
+                   long int len) {
+  b->tape->source = source;
+  b->tape->source_len = len;
+  if (len > 1) { /* As if branch_create had written them */
+    b->hi = len - 1;
+    branch_regrow(tm, b);
+  }
+}
+
+/** Maps the rest of the input file, read-only, once for all its lines,
+  * from its position on. Returns false, leaving the file as it was, if it
+  * is not a regular file.
+  */
+bool input_map(tm_t * tm) {
+  long int page = sysconf(_SC_PAGESIZE);
+  long int pos = ftell(tm->in);
+  struct stat st;
+
+  if (pos < 0 || fstat(fileno(tm->in), &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size <= pos) {
+    return false;
+  }
+  tm->map_base = pos - pos % page; /* Mappings start on a page */
+  tm->map_len = (size_t) (st.st_size - tm->map_base);
+  tm->map = (char *) mmap(NULL, tm->map_len, PROT_READ, MAP_PRIVATE,
+                          fileno(tm->in), tm->map_base);
+  if (tm->map == MAP_FAILED) {
+    tm->map = NULL;
+    return false;
+  }
+  tm->map_pos = pos - tm->map_base;
+  return true;
+}
+
+/** Returns the next line of the mapped file, without its newline, and its
+  * length in len.
+  */
+const char * input_line(tm_t * tm, long int * len) {
+  const char * line = tm->map + tm->map_pos, * end;
+
+  end = (const char *) memchr(line, '\n', tm->map_len - tm->map_pos);
+  *len = (end != NULL ? end : tm->map + tm->map_len) - line;
+  tm->map_pos += *len + (end != NULL);
+  return line;
+}
+
+/** Unmaps the input file, if mapped, and moves the file past the lines
+  * taken from the mapping. No tape may reference them anymore.
+  */
+void input_unmap(tm_t * tm) {
+  if (tm->map != NULL) {
+    fseek(tm->in, tm->map_base + tm->map_pos, SEEK_SET);
+    munmap(tm->map, tm->map_len);
+    tm->map = NULL;
+  }
+}
+
+/**
+  * BATCH MANIFEST
+  * Each line of a manifest names a machine file (the "tr", "acc" and "max"
+  * sections), an input file (one string per line) and an output file.
+  * The jobs are taken by a pool of worker threads, each with its own page
+  * store; a machine is loaded once and shared read-only by all its jobs.
+  */
+
+/* Runs all the jobs of a manifest, returns the exit status */
+int batch_run(tm_t * options, const char * manifest, int workers) {
+  batch_t batch;
+  pthread_t * threads;
+  machine_entry_t * e;
+  struct timespec start, end;
+  char *line = NULL, *m, *in, *out;
+  size_t cap = 0;
+  long int len;
+  int line_no = 0, job_cap = 0, bad_lines = 0;
+  double elapsed;
+  FILE * f;
+
+  f = fopen(manifest, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open %s\n", manifest);
+    return 1;
+  }
+  batch.options = options;
+  batch.jobs = NULL;
+  batch.job_count = 0;
+  batch.next_job = 0;
+  batch.machines = NULL;
+  batch.machines_loaded = 0;
+  batch.machines_reused = 0;
+  batch.inputs = 0;
+  batch.failed = 0;
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.loaded, NULL);
+
+  /* 1. Read the jobs, skipping blank lines and comments */
+  while ((len = getline(&line, &cap, f)) != -1) {
+    line_no++;
+    m = (char *) malloc(len + 1);
+    in = (char *) malloc(len + 1);
+    out = (char *) malloc(len + 1);
+    if (line[0] != '#' && sscanf(line, "%s %s %s", m, in, out) == 3) {
+      if (batch.job_count == job_cap) {
+        job_cap = job_cap > 0 ? job_cap * 2 : 64;
+        batch.jobs = (job_t *) realloc(batch.jobs, job_cap * sizeof(job_t));
+      }
+      batch.jobs[batch.job_count].machine = m;
+      batch.jobs[batch.job_count].input = in;
+      batch.jobs[batch.job_count].output = out;
+      batch.job_count++;
+      continue;
+    }
+    if (line[0] != '#' && sscanf(line, "%s", m) == 1) {
+      fprintf(stderr, "%s:%d: expected MACHINE INPUT OUTPUT\n",
+        manifest, line_no);
+      bad_lines++;
+    }
+    free(m);
+    free(in);
+    free(out);
+  }
+  free(line);
+  fclose(f);
+
+  /* 2. Run them on the worker pool */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (workers > batch.job_count) {
+    workers = batch.job_count;
+  }
+  threads = (pthread_t *) malloc((workers > 0 ? workers : 1) * sizeof(pthread_t));
+  for (int i = 0; i < workers; i++) {
+    pthread_create(&threads[i], NULL, batch_worker, &batch);
+  }
+  for (int i = 0; i < workers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  /* 3. Report the throughput */
+  fprintf(stderr, "Batch: %d jobs, %d failed, %ld inputs in %.3fs "
+    "(%.1f jobs/s, %.1f inputs/s), %d machines loaded, %d reused\n",
+    batch.job_count, batch.failed, batch.inputs, elapsed,
+    elapsed > 0 ? batch.job_count / elapsed : 0.0,
+    elapsed > 0 ? batch.inputs / elapsed : 0.0,
+    batch.machines_loaded, batch.machines_reused);
+
+  /* 4. Clear memory */
+  while (batch.machines != NULL) {
+    e = batch.machines;
+    batch.machines = e->next;
+    tm_destroy(e->tm);
+    free(e->tm);
+    free(e->text);
+    free(e);
+  }
+  for (int i = 0; i < batch.job_count; i++) {
+    free(batch.jobs[i].machine);
+    free(batch.jobs[i].input);
+    free(batch.jobs[i].output);
+  }
+  free(batch.jobs);
+  pthread_mutex_destroy(&batch.lock);
+  pthread_cond_destroy(&batch.loaded);
+  return batch.failed > 0 || bad_lines > 0 ? 1 : 0;
+}
+
+/* Worker thread: takes jobs until there are none left */
+void * batch_worker(void * arg) {
+  batch_t * batch = (batch_t *) arg;
+  job_t * job;
+
+  store_init();
+  while (true) {
+    pthread_mutex_lock(&batch->lock);
+    job = batch->next_job < batch->job_count ?
+          &batch->jobs[batch->next_job++] : NULL;
+    pthread_mutex_unlock(&batch->lock);
+    if (job == NULL) {
+      break;
+    }
+    if (!batch_job(batch, job)) {
+      pthread_mutex_lock(&batch->lock);
+      batch->failed++;
+      pthread_mutex_unlock(&batch->lock);
+    }
+  }
+  store_destroy();
+  return NULL;
+}
+
+/** Runs the machine of a job on its input file.
+  * The loaded machine is only read while running, so the job works on a
+  * shallow copy of it, with its own runqueue, files and input buffer.
+  */
+bool batch_job(batch_t * batch, job_t * job) {
+  tm_t * machine = batch_machine(batch, job->machine);
+  tm_t tm;
+
+  if (machine == NULL) {
+    return false;
+  }
+  tm = *machine;
+  tm.in = fopen(job->input, "r");
+  if (tm.in == NULL) {
+    fprintf(stderr, "Cannot open %s\n", job->input);
+    return false;
+  }
+  tm.out = fopen(job->output, "w");
+  if (tm.out == NULL) {
+    fprintf(stderr, "Cannot open %s\n", job->output);
+    fclose(tm.in);
+    return false;
+  }
+  tm.line = NULL;
+  tm.line_cap = 0;
+  tm.inputs = 0;
+  tm.probe = NULL; /* The threads of the walks are the job's own */
+
+  tm_run_inputs(&tm);
+
+  free(tm.line);
+  probe_destroy(tm.probe);
+  fclose(tm.in);
+  fclose(tm.out);
+  pthread_mutex_lock(&batch->lock);
+  batch->inputs += tm.inputs;
+  pthread_mutex_unlock(&batch->lock);
+  return true;
+}
+
+/** Returns the loaded machine of a file, from the cache if a file with the
+  * same content has already been loaded. NULL if it cannot be read.
+  */
+tm_t * batch_machine(batch_t * batch, const char * path) {
+  machine_entry_t * e;
+  tm_t * tm;
+  long int size;
+  char * text = file_read(path, &size);
+  uint64_t hash;
+
+  if (text == NULL || size == 0) {
+    fprintf(stderr, "Cannot read %s\n", path);
+    free(text);
+    return NULL;
+  }
+  hash = text_hash(text, size);
+
+  pthread_mutex_lock(&batch->lock);
+  for (e = batch->machines; e != NULL; e = e->next) {
+    if (e->hash == hash && e->size == size &&
+        memcmp(e->text, text, size) == 0) {
+      break;
+    }
+  }
+  if (e != NULL) { /* Cached, wait for it if another worker is loading it */
+    while (!e->loaded) {
+      pthread_cond_wait(&batch->loaded, &batch->lock);
+    }
+    batch->machines_reused++;
+    pthread_mutex_unlock(&batch->lock);
+    free(text);
+    return e->tm;
+  }
+  e = (machine_entry_t *) malloc(sizeof(machine_entry_t));
+  e->hash = hash;
+  e->size = size;
+  e->text = text;
+  e->loaded = false;
+  e->tm = (tm_t *) malloc(sizeof(tm_t));
+  e->next = batch->machines;
+  batch->machines = e;
+  batch->machines_loaded++;
+  pthread_mutex_unlock(&batch->lock);
+
+  /* Load it out of the lock, with the options of the command line */
+  tm = e->tm;
+  *tm = tm_load_text(batch->options, text, size);
+
+  pthread_mutex_lock(&batch->lock);
+  e->loaded = true;
+  pthread_cond_broadcast(&batch->loaded);
+  pthread_mutex_unlock(&batch->lock);
+  return tm;
+}
+
+/* Reads a stream till the end */
+char * stream_read(FILE * f, long int * size) {
+  long int cap = 4096;
+  char * text = (char *) malloc(cap);
+  size_t n;
+
+  *size = 0;
+  while ((n = fread(text + *size, 1, cap - *size, f)) > 0) {
+    *size += n;
+    if (*size == cap) {
+      cap *= 2;
+      text = (char *) realloc(text, cap);
+    }
+  }
+  return text;
+}
+
+/* Reads a whole file, NULL if it cannot be read */
+char * file_read(const char * path, long int * size) {
+  FILE * f = fopen(path, "rb");
+  char * text;
+
+  if (f == NULL) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  text = (char *) malloc(*size > 0 ? *size : 1);
+  if (fread(text, 1, *size, f) != (size_t) *size) {
+    free(text);
+    text = NULL;
+  }
+  fclose(f);
+  return text;
+}
+
+/** Splits a description at its "run" line: returns where the machine ends
+  * and sets lines to the first input line, both are end if there is none.
+  */
+char * text_split(char * text, char * end, char ** lines) {
+  char *p, *eol;
+
+  for (p = text; p < end; p = eol + 1) {
+    eol = memchr(p, '\n', end - p);
+    if (eol == NULL) {
+      eol = end;
+    }
+    if (eol - p == 3 && strncmp(p, "run", 3) == 0) {
+      *lines = eol < end ? eol + 1 : end;
+      return p;
+    }
+  }
+  *lines = end;
+  return end;
+}
+
+/* FNV-1a hash of a buffer */
+uint64_t text_hash(const char * text, long int size) {
+  uint64_t h = 14695981039346656037ULL;
+  for (long int i = 0; i < size; i++) {
+    h = (h ^ (unsigned char) text[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+/**
+  * MULTI-NODE
+  * A coordinator reads the machine and the run section from stdin, then
+  * hands chunks of input lines over TCP to `--worker` processes, one
+  * thread per worker. A worker which fails gives its chunk back to the
+  * others; the chunk size of each worker follows its completion times.
+  * Messages are a type byte, a 64 bits big-endian length and the data:
+  * 'M' the machine description, 'C' a chunk of lines, 'A' their answers.
+  */
+
+/* Coordinator: shards the run section of stdin among the workers */
+int cluster_coordinate(tm_t * options, char * workers) {
+  cluster_t c;
+  node_t * nodes = NULL;
+  int node_count = 0;
+  char *text, *p, *end, *sep;
+  long int size, answers_len;
+  range_t r;
+  tm_t tm;
+
+  /* 1. Split stdin in the machine description and the input lines */
+  text = stream_read(stdin, &size);
+  end = text + size;
+  c.machine = text;
+  c.machine_len = text_split(text, end, &p) - text;
+  c.line_count = 0;
+  c.lines = NULL;
+  c.lines_end = end;
+  for (; p < end; p = sep + 1) {
+    if (c.line_count % 1024 == 0) {
+      c.lines = (char **) realloc(c.lines, (c.line_count + 1024) * sizeof(char *));
+    }
+    c.lines[c.line_count++] = p;
+    sep = memchr(p, '\n', end - p);
+    if (sep == NULL) {
+      sep = end;
+    }
+  }
+  c.answers = (char *) calloc(c.line_count + 1, 1);
+  c.next_line = 0;
+  c.retry = NULL;
+  c.retry_count = 0;
+  c.retry_cap = 0;
+  c.in_flight = 0;
+  pthread_mutex_init(&c.lock, NULL);
+  pthread_cond_init(&c.changed, NULL);
+
+  /* 2. One thread per worker, HOST:PORT separated by commas */
+  for (p = strtok(workers, ","); p != NULL; p = strtok(NULL, ",")) {
+    sep = strrchr(p, ':');
+    if (sep == NULL) {
+      fprintf(stderr, "Expected HOST:PORT, got %s\n", p);
+      continue;
+    }
+    *sep = '\0';
+    nodes = (node_t *) realloc(nodes, (node_count + 1) * sizeof(node_t));
+    nodes[node_count].cluster = &c;
+    nodes[node_count].host = p;
+    nodes[node_count].port = sep + 1;
+    nodes[node_count].chunks = 0;
+    nodes[node_count].lines = 0;
+    nodes[node_count].failed = false;
+    node_count++;
+  }
+  for (int i = 0; i < node_count; i++) {
+    pthread_create(&nodes[i].thread, NULL, cluster_node, &nodes[i]);
+  }
+  for (int i = 0; i < node_count; i++) {
+    pthread_join(nodes[i].thread, NULL);
+    fprintf(stderr, "Worker %s:%s: %ld chunks, %ld lines%s\n",
+      nodes[i].host, nodes[i].port, nodes[i].chunks, nodes[i].lines,
+      nodes[i].failed ? ", failed" : "");
+  }
+
+  /* 3. If every worker failed, run what is left here */
+  if (c.next_line < c.line_count || c.retry_count > 0) {
+    fprintf(stderr, "No workers left, running the remaining lines locally\n");
+    tm = tm_load_text(options, c.machine, c.machine_len);
+    r.count = CHUNK_LINES;
+    while (cluster_take(&c, &r)) {
+      p = cluster_chunk(&c, &r, &size);
+      sep = tm_answer_text(&tm, p, size, &answers_len);
+      cluster_done(&c, &r, sep);
+      free(sep);
+      free(p);
+    }
+    tm_destroy(&tm);
+  }
+
+  /* 4. Print the answers in order */
+  for (long int i = 0; i < c.line_count; i++) {
+    printf("%c\n", c.answers[i]);
+  }
+
+  pthread_mutex_destroy(&c.lock);
+  pthread_cond_destroy(&c.changed);
+  free(nodes);
+  free(c.retry);
+  free(c.answers);
+  free(c.lines);
+  free(text);
+  return 0;
+}
+
+/** Coordinator thread of a worker: sends it the machine, then chunks of
+  * lines until there are none left, or until it fails.
+  */
+void * cluster_node(void * arg) {
+  node_t * n = (node_t *) arg;
+  cluster_t * c = n->cluster;
+  long int size, lines = CHUNK_LINES, len, elapsed_ms;
+  struct timespec start, end;
+  char *chunk, *answers, type;
+  range_t r;
+  int fd;
+
+  fd = net_connect(n->host, n->port);
+  if (fd < 0 || !net_send(fd, 'M', c->machine, c->machine_len)) {
+    fprintf(stderr, "Cannot reach worker %s:%s\n", n->host, n->port);
+    n->failed = true;
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  r.count = lines;
+  while (cluster_take(c, &r)) {
+    chunk = cluster_chunk(c, &r, &size);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    answers = NULL;
+    if (net_send(fd, 'C', chunk, size)) {
+      answers = net_recv(fd, &type, &len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(chunk);
+
+    if (answers == NULL || type != 'A' || len != 2 * r.count) {
+      fprintf(stderr, "Worker %s:%s failed, retrying its chunk\n",
+        n->host, n->port);
+      free(answers);
+      cluster_give_back(c, &r);
+      n->failed = true;
+      break;
+    }
+    cluster_done(c, &r, answers);
+    free(answers);
+    n->chunks++;
+    n->lines += r.count;
+
+    /* Size the next chunk to last about CHUNK_TARGET_MS on this worker */
+    elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 +
+                 (end.tv_nsec - start.tv_nsec) / 1000000;
+    lines = elapsed_ms > 0 ? r.count * CHUNK_TARGET_MS / elapsed_ms :
+                             r.count * 2;
+    if (lines > 2 * r.count) { /* Grow gradually */
+      lines = 2 * r.count;
+    }
+    r.count = lines > 0 ? lines : 1;
+  }
+  close(fd);
+  return NULL;
+}
+
+/** Takes the next range to run, at most r->count lines, from the ranges
+  * given back first. Waits while other workers may still give some back.
+  * Returns false when all the lines are done.
+  */
+bool cluster_take(cluster_t * c, range_t * r) {
+  bool taken = false;
+
+  pthread_mutex_lock(&c->lock);
+  while (true) {
+    if (c->retry_count > 0) {
+      *r = c->retry[--c->retry_count];
+      taken = true;
+    } else if (c->next_line < c->line_count) {
+      r->first = c->next_line;
+      if (r->count > c->line_count - c->next_line) {
+        r->count = c->line_count - c->next_line;
+      }
+      c->next_line += r->count;
+      taken = true;
+    } else if (c->in_flight > 0) {
+      pthread_cond_wait(&c->changed, &c->lock);
+      continue;
+    }
+    break;
+  }
+  if (taken) {
+    c->in_flight++;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return taken;
+}
+
+/* Stores the answers of a range, given as "c\n" pairs */
+void cluster_done(cluster_t * c, range_t * r, const char * answers) {
+  pthread_mutex_lock(&c->lock);
+  for (long int i = 0; i < r->count; i++) {
+    c->answers[r->first + i] = answers[2 * i];
+  }
+  c->in_flight--;
+  pthread_cond_broadcast(&c->changed);
+  pthread_mutex_unlock(&c->lock);
+}
+
+/* Gives back a range that a failed worker could not run */
+void cluster_give_back(cluster_t * c, range_t * r) {
+  pthread_mutex_lock(&c->lock);
+  if (c->retry_count == c->retry_cap) {
+    c->retry_cap = c->retry_cap > 0 ? c->retry_cap * 2 : 16;
+    c->retry = (range_t *) realloc(c->retry, c->retry_cap * sizeof(range_t));
+  }
+  c->retry[c->retry_count++] = *r;
+  c->in_flight--;
+  pthread_cond_broadcast(&c->changed);
+  pthread_mutex_unlock(&c->lock);
+}
+
+/* Copies the lines of a range, each one ended by a newline */
+char * cluster_chunk(cluster_t * c, range_t * r, long int * len) {
+  char *chunk = NULL, *p, *eol;
+  long int size = 0, n;
+
+  for (int pass = 0; pass < 2; pass++) { /* Measure, then copy */
+    if (pass == 1) {
+      chunk = (char *) malloc(size);
+      size = 0;
+    }
+    for (long int i = r->first; i < r->first + r->count; i++) {
+      p = c->lines[i];
+      eol = memchr(p, '\n', c->lines_end - p);
+      n = (eol != NULL ? eol : c->lines_end) - p;
+      if (pass == 1) {
+        memcpy(chunk + size, p, n);
+        chunk[size + n] = '\n';
+      }
+      size += n + 1;
+    }
+  }
+  *len = size;
+  return chunk;
+}
+
+/** Worker: answers the chunks of the coordinators connecting to a port
+  * of the given address. Any peer reaching it can make it run machines,
+  * so it is loopback unless asked otherwise.
+  */
+int cluster_serve(tm_t * options, const char * host, const char * port) {
+  struct addrinfo hints, *ai;
+  int fd, conn, on = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &ai) != 0) {
+    fprintf(stderr, "Invalid address %s port %s\n", host, port);
+    return 1;
+  }
+  fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (fd < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+      bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 8) != 0) {
+    fprintf(stderr, "Cannot listen on %s port %s\n", host, port);
+    if (fd >= 0) {
+      close(fd);
+    }
+    freeaddrinfo(ai);
+    return 1;
+  }
+  freeaddrinfo(ai);
+  fprintf(stderr, "Worker listening on %s port %s\n", host, port);
+
+  while (true) { /* One coordinator at a time */
+    conn = accept(fd, NULL, NULL);
+    if (conn >= 0) {
+      setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      cluster_serve_conn(options, conn);
+      close(conn);
+    }
+  }
+  return 0;
+}
+
+/* Worker side of a connection: loads the machine, then answers chunks */
+void cluster_serve_conn(tm_t * options, int fd) {
+  bool loaded = false;
+  char *data, *answers, type;
+  long int len, answers_len;
+  tm_t tm;
+
+  while ((data = net_recv(fd, &type, &len)) != NULL) {
+    if (type == 'M' && len > 0) {
+      if (loaded) {
+        tm_destroy(&tm);
+      }
+      tm = tm_load_text(options, data, len);
+      loaded = true;
+    } else if (type == 'X' && loaded && len >= 16) {
+      explore_serve(&tm, fd, data, len);
+    } else if (type == 'C' && loaded && len > 0) {
+      answers = tm_answer_text(&tm, data, len, &answers_len);
+      net_send(fd, 'A', answers, answers_len);
+      free(answers);
+    }
+    free(data);
+  }
+  if (loaded) {
+    tm_destroy(&tm);
+  }
+}
+
+/* Connects to a host, returns the socket or -1 */
+int net_connect(const char * host, const char * port) {
+  struct addrinfo hints, *ai, *a;
+  int fd = -1, on = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &ai) != 0) {
+    return -1;
+  }
+  for (a = ai; a != NULL; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      break;
+    }
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(ai);
+  return fd;
+}
+
+/* Sends a message, returns false if the connection is broken */
+bool net_send(int fd, char type, const char * data, long int len) {
+  unsigned char header[9];
+  long int sent = 0, n;
+
+  header[0] = (unsigned char) type;
+  put_u64((char *) header + 1, (uint64_t) len);
+  if (send(fd, header, sizeof(header), MSG_NOSIGNAL) != sizeof(header)) {
+    return false;
+  }
+  while (sent < len) {
+    n = send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+/** Receives a message, returns its data, to be freed, or NULL if the
+  * connection is broken or closed, or if the message is longer than
+  * NET_MAX_MESSAGE: the length comes from the peer
+  */
+char * net_recv(int fd, char * type, long int * len) {
+  unsigned char header[9];
+  long int got = 0, n;
+  char * data;
+
+  while (got < (long int) sizeof(header)) {
+    n = recv(fd, header + got, sizeof(header) - got, 0);
+    if (n <= 0) {
+      return NULL;
+    }
+    got += n;
+  }
+  *type = (char) header[0];
+  if (get_u64((char *) header + 1) > (uint64_t) NET_MAX_MESSAGE) {
+    fprintf(stderr, "Message of %llu bytes refused, the most is %ld\n",
+      (unsigned long long) get_u64((char *) header + 1), NET_MAX_MESSAGE);
+    return NULL;
+  }
+  *len = (long int) get_u64((char *) header + 1);
+  data = (char *) malloc(*len > 0 ? *len : 1);
+  if (data == NULL) {
+    fprintf(stderr, "Cannot allocate a message of %ld bytes\n", *len);
+    return NULL;
+  }
+  for (got = 0; got < *len; got += n) {
+    n = recv(fd, data + got, *len - got, 0);
+    if (n <= 0) {
+      free(data);
+      return NULL;
+    }
+  }
+  return data;
+}
+
+/* Stores a 64 bits big-endian number */
+void put_u64(char * dst, uint64_t v) {
+  for (int i = 0; i < 8; i++) {
+    dst[7 - i] = (char) (v >> (8 * i));
+  }
+}
+
+/* Loads a 64 bits big-endian number */
+uint64_t get_u64(const char * src) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++) {
+    v = v << 8 | (unsigned char) src[i];
+  }
+  return v;
+}
+
+/**
+  * DISTRIBUTED EXPLORATION
+  * The computation tree of a single input is spread over `--worker`
+  * processes. Every worker runs its own runqueue; when it holds more than
+  * EXPLORE_KEEP branches it serializes the others and ships each one to
+  * the worker its content hashes to, through the coordinator.
+  * The coordinator forwards the batches of branches and detects the end:
+  * a worker reports when it runs out of branches with the number of
+  * batches it got, the tree is done when all the workers are idle and
+  * have got every batch forwarded to them. The first worker to accept
+  * (or to hit a limit) stops all the others.
+  * Messages, besides 'M': 'X' an input with the rank of the worker and the
+  * number of workers, 'B' a batch of branches, 'I' idle, 'R' a result,
+  * 'S' stop, 'D' done with the input.
+  */
+
+/* Coordinator: explores each input of stdin over all the workers */
+int explore_coordinate(tm_t * options, char * workers) {
+  peer_t * peers = NULL;
+  int peer_count = 0, live;
+  char *text, *end, *machine_end, *p, *eol, *answers;
+  long int size, answers_len;
+  bool loaded = false;
+  tm_t tm;
+  char c;
+
+  /* 1. Connect to the workers and send them the machine */
+  text = stream_read(stdin, &size);
+  end = text + size;
+  machine_end = text_split(text, end, &p);
+  for (char * w = strtok(workers, ","); w != NULL; w = strtok(NULL, ",")) {
+    eol = strrchr(w, ':');
+    if (eol == NULL) {
+      fprintf(stderr, "Expected HOST:PORT, got %s\n", w);
+      continue;
+    }
+    *eol = '\0';
+    peers = (peer_t *) realloc(peers, (peer_count + 1) * sizeof(peer_t));
+    memset(&peers[peer_count], 0, sizeof(peer_t));
+    peers[peer_count].host = w;
+    peers[peer_count].port = eol + 1;
+    peers[peer_count].fd = net_connect(w, eol + 1);
+    if (peers[peer_count].fd < 0 || !net_send(peers[peer_count].fd, 'M',
+          text, machine_end - text)) {
+      fprintf(stderr, "Cannot reach worker %s:%s\n", w, eol + 1);
+      peer_fail(&peers[peer_count]);
+    }
+    peer_count++;
+  }
+
+  /* 2. Explore each input, locally if no worker is left */
+  for (; p < end; p = eol + 1) {
+    eol = memchr(p, '\n', end - p);
+    if (eol == NULL) {
+      eol = end;
+    }
+    live = 0;
+    for (int i = 0; i < peer_count; i++) {
+      live += peers[i].fd >= 0;
+    }
+    if (live > 0) {
+      c = explore_input(peers, peer_count, p, eol - p);
+    } else {
+      if (!loaded) {
+        fprintf(stderr, "No workers left, running the inputs locally\n");
+        tm = tm_load_text(options, text, machine_end - text);
+        loaded = true;
+      }
+      answers = tm_answer_text(&tm, p, eol - p, &answers_len);
+      c = answers_len > 0 ? answers[0] : SYM_UNDET;
+      free(answers);
+    }
+    printf("%c\n", c);
+    fflush(stdout);
+  }
+
+  /* 3. Clean up */
+  for (int i = 0; i < peer_count; i++) {
+    fprintf(stderr, "Worker %s:%s: %ld batches of branches received%s\n",
+      peers[i].host, peers[i].port, peers[i].batches,
+      peers[i].fd < 0 ? ", failed" : "");
+    if (peers[i].fd >= 0) {
+      close(peers[i].fd);
+    }
+    free(peers[i].out);
+  }
+  if (loaded) {
+    tm_destroy(&tm);
+  }
+  free(peers);
+  free(text);
+  return 0;
+}
+
+/** Explores an input over the live workers, forwarding the batches of
+  * branches they exchange, until one of them answers or all are idle.
+  * Returns the answer: 0: refuse, 1: accept, U: undetermined
+  */
+char explore_input(peer_t * peers, int peer_count, char * line,
+                   long int len) {
+  struct pollfd * fds = (struct pollfd *) malloc(peer_count * sizeof(*fds));
+  peer_t ** ranks = (peer_t **) malloc(peer_count * sizeof(peer_t *));
+  char *start = (char *) malloc(16 + len), *data, type, c = SYM_REFUSE;
+  bool stopping = false, finished, preempted, lost;
+  int size = 0, dest;
+  long int data_len;
+
+  /* 1. Start the workers, ranked in order */
+  for (int i = 0; i < peer_count; i++) {
+    if (peers[i].fd >= 0) {
+      peers[i].rank = size;
+      ranks[size++] = &peers[i];
+    }
+  }
+  memcpy(start + 16, line, len);
+  put_u64(start + 8, size);
+  for (int i = 0; i < size; i++) {
+    ranks[i]->sent = ranks[i]->received = 0;
+    ranks[i]->idle = ranks[i]->preempted = ranks[i]->done = false;
+    put_u64(start, i);
+    peer_queue(ranks[i], 'X', start, 16 + len);
+  }
+  free(start);
+
+  while (true) {
+    /* 2. Check whether the tree is done */
+    finished = true;
+    preempted = lost = false;
+    for (int i = 0; i < size; i++) {
+      lost |= ranks[i]->fd < 0;
+      if (ranks[i]->fd >= 0) {
+        finished &= stopping ? ranks[i]->done :
+                    ranks[i]->idle && ranks[i]->received == ranks[i]->sent;
+        preempted |= ranks[i]->preempted;
+      }
+    }
+    if (finished && stopping) {
+      break;
+    } else if (!stopping && (finished || lost)) { /* All run, or lost */
+      c = preempted || lost ? SYM_UNDET : SYM_REFUSE;
+      explore_stop(peers, peer_count);
+      stopping = true;
+      continue;
+    }
+
+    /* 3. Wait for messages, or for room to send the queued ones */
+    for (int i = 0; i < size; i++) {
+      fds[i].fd = ranks[i]->fd;
+      fds[i].events = POLLIN;
+      if (ranks[i]->out_sent < ranks[i]->out_len) {
+        fds[i].events |= POLLOUT;
+      }
+      fds[i].revents = 0;
+    }
+    poll(fds, size, -1);
+
+    for (int i = 0; i < size; i++) {
+      if (ranks[i]->fd < 0 || fds[i].revents == 0) {
+        continue;
+      }
+      data = NULL;
+      if ((fds[i].revents & POLLOUT) != 0 && !peer_flush(ranks[i])) {
+        type = 0;
+      } else if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+        data = net_recv(ranks[i]->fd, &type, &data_len);
+        if (data == NULL) {
+          type = 0;
+        }
+      } else {
+        continue;
+      }
+
+      if (type == 0) { /* Its part of the tree is lost, if still running */
+        fprintf(stderr, "Worker %s:%s failed\n",
+          ranks[i]->host, ranks[i]->port);
+        peer_fail(ranks[i]);
+      } else if (type == 'B' && !stopping && data_len > 8) {
+        dest = (int) get_u64(data);
+        if (dest >= 0 && dest < size && ranks[dest]->fd >= 0) {
+          peer_queue(ranks[dest], 'B', data + 8, data_len - 8);
+          ranks[dest]->sent++;
+          ranks[dest]->batches++;
+        }
+        ranks[i]->idle = false;
+      } else if (type == 'I' && data_len == 9) {
+        ranks[i]->idle = true;
+        ranks[i]->received = (long int) get_u64(data);
+        ranks[i]->preempted |= data[8] != 0;
+      } else if (type == 'R' && !stopping && data_len == 1) {
+        c = data[0];
+        explore_stop(peers, peer_count);
+        stopping = true;
+      } else if (type == 'D') {
+        ranks[i]->done = true;
+      }
+      free(data);
+    }
+  }
+
+  free(fds);
+  free(ranks);
+  return c;
+}
+
+/* Asks every live worker to stop the current input */
+void explore_stop(peer_t * peers, int peer_count) {
+  for (int i = 0; i < peer_count; i++) {
+    if (peers[i].fd >= 0) {
+      peer_queue(&peers[i], 'S', NULL, 0);
+    }
+  }
+}
+
+/* Queues a message for a worker, and sends as much as possible of it */
+void peer_queue(peer_t * p, char type, const char * data, long int len) {
+  if (p->out_len + 9 + len > p->out_cap) {
+    p->out_cap = (p->out_len + 9 + len) * 2;
+    p->out = (char *) realloc(p->out, p->out_cap);
+  }
+  p->out[p->out_len] = type;
+  put_u64(p->out + p->out_len + 1, (uint64_t) len);
+  if (len > 0) {
+    memcpy(p->out + p->out_len + 9, data, len);
+  }
+  p->out_len += 9 + len;
+  if (!peer_flush(p)) {
+    fprintf(stderr, "Worker %s:%s failed\n", p->host, p->port);
+    peer_fail(p);
+  }
+}
+
+/** Sends the queued messages of a worker until its socket is full,
+  * returns false if the connection is broken.
+  */
+bool peer_flush(peer_t * p) {
+  long int n;
+
+  while (p->fd >= 0 && p->out_sent < p->out_len) {
+    n = send(p->fd, p->out + p->out_sent, p->out_len - p->out_sent,
+             MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return true; /* Try again when poll says so */
+    } else if (n <= 0) {
+      return false;
+    }
+    p->out_sent += n;
+  }
+  p->out_len = p->out_sent = 0;
+  return true;
+}
+
+/* Drops a failed worker */
+void peer_fail(peer_t * p) {
+  if (p->fd >= 0) {
+    close(p->fd);
+  }
+  p->fd = -1;
+  p->out_len = p->out_sent = 0;
+}
+
+/** Worker: explores its share of the tree of an input, as told by an 'X'
+  * message, until the coordinator stops it.
+  */
+void explore_serve(tm_t * tm, int fd, char * data, long int len) {
+  explore_t x;
+  branch_t *root, *b;
+  char *rec = NULL, c;
+  long int rec_len = 0, rec_cap = 0, n = 0;
+
+  x.fd = fd;
+  x.rank = (int) get_u64(data);
+  x.size = (int) get_u64(data + 8);
+  x.received = 0;
+  x.stopped = false;
+  if (x.size <= 0) {
+    x.size = 1;
+  }
+
+  /* 1. Create the root, only the worker it hashes to keeps it */
+  for (long int i = 16; i < len && n <= tm->max_steps; i++) {
+    if (n == tm->line_cap) {
+      tm->line_cap = tm->line_cap > 0 ? tm->line_cap * 2 : 256;
+      tm->line = (char *) realloc(tm->line, tm->line_cap);
+    }
+    tm->line[n++] = (char) tm->alpha.code[(unsigned char) data[i]];
+  }
+  tm->mem_base = mem_held;
+  root = branch_create(tm, tm->line, 0, n);
+  tm_begin(tm);
+  tm->explore = &x;
+  branch_save(root, tm, &rec, &rec_len, &rec_cap);
+  if (text_hash(rec, rec_len) % x.size == (uint64_t) x.rank) {
+    rq_enqueue(tm, root);
+  } else {
+    branch_destroy(root);
+  }
+  free(rec);
+
+  /* 2. Run until done, then wait for the coordinator to stop the input */
+  c = tm_compute_rq(tm);
+  if (!x.stopped) {
+    if (tm->limit != NULL) {
+      fprintf(stderr, "Input %ld: %s reached, answering %c\n",
+        tm->inputs, tm->limit, c);
+    }
+    net_send(fd, 'R', &c, 1);
+  }
+  while (!x.stopped) {
+    explore_recv(tm, true);
+  }
+
+  /* 3. Empty the runqueue */
+  while (tm->rq_head != NULL) {
+    b = rq_dequeue(tm);
+    branch_destroy(b);
+  }
+  tm->explore = NULL;
+  net_send(fd, 'D', NULL, 0);
+}
+
+/** Called by a worker without branches: tells the coordinator, then waits
+  * for more branches. Returns false when the input is stopped.
+  */
+bool explore_idle(tm_t * tm, bool preempted) {
+  explore_t * x = tm->explore;
+  char report[9];
+
+  put_u64(report, x->received);
+  report[8] = preempted;
+  if (!x->stopped && !net_send(x->fd, 'I', report, sizeof(report))) {
+    x->stopped = true;
+  }
+  while (tm->rq_head == NULL && !x->stopped) {
+    explore_recv(tm, true);
+  }
+  return !x->stopped;
+}
+
+/** Called periodically by a worker: takes the branches sent to it and
+  * ships the ones it has too many of. Returns true if the input is stopped.
+  */
+bool explore_sync(tm_t * tm) {
+  while (explore_recv(tm, false)) {
+    continue;
+  }
+  if (!tm->explore->stopped && tm->explore->size > 1 &&
+      tm->rq_len > EXPLORE_KEEP) {
+    explore_ship(tm);
+  }
+  return tm->explore->stopped;
+}
+
+/** Handles a message from the coordinator, without waiting for it unless
+  * told to. Returns false if there was none.
+  */
+bool explore_recv(tm_t * tm, bool wait) {
+  explore_t * x = tm->explore;
+  struct pollfd pfd;
+  long int len, n;
+  char *data, type;
+  branch_t * b;
+
+  pfd.fd = x->fd;
+  pfd.events = POLLIN;
+  if (x->stopped || (!wait && poll(&pfd, 1, 0) <= 0)) {
+    return false;
+  }
+  data = net_recv(x->fd, &type, &len);
+  if (data == NULL) { /* The coordinator is gone */
+    x->stopped = true;
+    return false;
+  }
+  if (type == 'B') {
+    x->received++;
+    for (long int i = 0; i < len; i += n) {
+      n = len - i;
+      b = branch_load(tm, data + i, &n);
+      if (b == NULL) {
+        break;
+      }
+      rq_enqueue(tm, b);
+    }
+  } else if (type == 'S') {
+    x->stopped = true;
+  }
+  free(data);
+  return true;
+}
+
+/** Ships the branches beyond EXPLORE_KEEP / 2 to the workers they hash to.
+  * A branch is placed only once: the ones which hash to this worker, or
+  * which were received, are settled here with all their descendants.
+  */
+void explore_ship(tm_t * tm) {
+  explore_t * x = tm->explore;
+  char ** batches = (char **) calloc(x->size, sizeof(char *));
+  long int * lens = (long int *) calloc(x->size, sizeof(long int));
+  long int * caps = (long int *) calloc(x->size, sizeof(long int));
+  long int count = tm->rq_len - EXPLORE_KEEP / 2, rec_len, rec_cap = 0;
+  branch_t *b, *kept = NULL;
+  char * rec = NULL;
+  int dest;
+
+  /* 1. Sort the oldest branches by the worker they hash to */
+  for (long int i = 0; i < count; i++) {
+    b = rq_dequeue(tm);
+    dest = x->rank;
+    if (!b->tape->settled) {
+      rec_len = 0;
+      branch_save(b, tm, &rec, &rec_len, &rec_cap);
+      dest = (int) (text_hash(rec, rec_len) % x->size);
+    }
+    if (dest == x->rank) { /* Keep it, queued again after the others */
+      b->tape->settled = true;
+      b->next = kept;
+      kept = b;
+      continue;
+    }
+    if (lens[dest] == 0) {
+      lens[dest] = 8; /* Room for the destination */
+    }
+    if (lens[dest] + rec_len > caps[dest]) {
+      caps[dest] = (lens[dest] + rec_len) * 2;
+      batches[dest] = (char *) realloc(batches[dest], caps[dest]);
+    }
+    memcpy(batches[dest] + lens[dest], rec, rec_len);
+    lens[dest] += rec_len;
+    branch_destroy(b);
+  }
+  while (kept != NULL) {
+    b = kept;
+    kept = b->next;
+    rq_enqueue(tm, b);
+  }
+
+  /* 2. Send the batches through the coordinator */
+  for (int d = 0; d < x->size; d++) {
+    if (lens[d] > 0 && !x->stopped) {
+      put_u64(batches[d], d);
+      if (!net_send(x->fd, 'B', batches[d], lens[d])) {
+        x->stopped = true;
+      }
+    }
+    free(batches[d]);
+  }
+  free(rec);
+  free(batches);
+  free(lens);
+  free(caps);
+}
+
+/** Serializes a branch at the end of a buffer: its state, transition,
+  * steps and head, then the cells of its tape from the first to the last
+  * non-blank one. Returns the length of the record.
+  */
+long int branch_save(branch_t * b, tm_t * tm, char ** buf, long int * len,
+                     long int * cap) {
+  tape_t * t = b->tape;
+  long int cpp, first, count, head, lo = -1, hi = -1;
+  branch_t probe;
+  char *rec, c;
+
+  /* 1. Find the materialized region */
+  if (t->packed != NULL) {
+    t->ops->unpack(b);
+  }
+  if (t->ops == &rle_tape) {
+    first = t->first_cell;
+    count = t->cell_count;
+    head = b->head_cell;
+  } else if (t->ops == &flat_tape) {
+    first = t->lo;
+    count = t->lo <= t->hi ? t->hi - t->lo + 1 : 0;
+    head = b->head_ptr - t->cells;
+  } else {
+    cpp = t->ops == &packed_tape ? t->alpha->cpp : PAGE_SIZE;
+    first = t->first_pnum * cpp;
+    count = t->page_count * cpp;
+    head = b->head_pnum * cpp + b->head_pos;
+  }
+  if (*len + BRANCH_HEADER + count > *cap) {
+    *cap = (*len + BRANCH_HEADER + count) * 2;
+    *buf = (char *) realloc(*buf, *cap);
+  }
+  rec = *buf + *len;
+
+  /* 2. Copy its cells without the blanks at both ends */
+  probe = *b;
+  t->ops->seek(&probe, first);
+  for (long int i = 0; i < count; i++) {
+    c = t->ops->read(&probe);
+    if (c != BLANK_ID) {
+      if (lo < 0) {
+        lo = i;
+      }
+      hi = i;
+    }
+    rec[BRANCH_HEADER + i] = c;
+    t->ops->move(&probe, 'R');
+  }
+  count = lo < 0 ? 0 : hi - lo + 1;
+  if (lo > 0) {
+    memmove(rec + BRANCH_HEADER, rec + BRANCH_HEADER + lo, count);
+    first += lo;
+  }
+
+  /* 3. Then the header */
+  put_u64(rec, b->state - tm->states);
+  put_u64(rec + 8, b->tr == NULL ? 0 : b->tr - tm->tr_outputs + 1);
+  put_u64(rec + 16, b->steps);
+  put_u64(rec + 24, head);
+  put_u64(rec + 32, first);
+  put_u64(rec + 40, count);
+  *len += BRANCH_HEADER + count;
+  return BRANCH_HEADER + count;
+}
+
+/** Rebuilds a branch serialized by branch_save, given at most len bytes.
+  * Sets len to the length of the record, returns NULL if it is invalid.
+  */
+branch_t * branch_load(tm_t * tm, const char * rec, long int * len) {
+  uint64_t state, tr, count;
+  long int steps;
+  branch_t * b;
+
+  if (*len < BRANCH_HEADER) {
+    return NULL;
+  }
+  state = get_u64(rec);
+  tr = get_u64(rec + 8);
+  steps = (long int) get_u64(rec + 16);
+  count = get_u64(rec + 40);
+  if (state > (uint64_t) tm->max_state || tr > (uint64_t) tm->tr_count ||
+      steps < 0 || steps > tm->max_steps ||
+      count > (uint64_t) (*len - BRANCH_HEADER)) {
+    return NULL;
+  }
+  b = branch_create(tm, rec + BRANCH_HEADER, (long int) get_u64(rec + 32),
+                    (long int) count);
+  b->state = &tm->states[state];
+  b->tr = tr == 0 ? NULL : &tm->tr_outputs[tr - 1];
+  b->steps = steps;
+  b->tape->ops->seek(b, (long int) get_u64(rec + 24));
+  b->tape->settled = true;
+  b->cell = (long int) get_u64(rec + 24); /* Its region starts here */
+  b->lo = b->cell < b->lo ? b->cell : b->lo;
+  b->hi = b->cell > b->hi ? b->cell : b->hi;
+  branch_regrow(tm, b);
+  *len = BRANCH_HEADER + (long int) count;
+  return b;
+}
+
+/**
+  * SHARED LIBRARY
+  * Built with -DLIBRARY as libtmsim.so (make libtmsim.so), for callers
+  * which load a machine once and run many strings in process, such as
+  * tmsim.py. A loaded machine is read-only: it can be run by any number
+  * of threads at once, each one with its own page store.
+  */
+
+/** Loads a machine from its description, the "tr", "acc" and "max"
+  * sections, with the given options (tape: NULL for the default, 0 for
+  * no limit). Returns NULL if the tape backend is unknown, or if the
+  * description is malformed: a section or the max steps are missing.
+  */
+tm_t * tmsim_load(const char * text, long int size, const char * tape,
+                  long int deadline_ms, long int step_budget,
+                  long int mem_cap_mb) {
+  tm_t options = tm_create();
+  tm_t * tm = NULL;
+
+  if (tape != NULL) {
+    options.tape_ops = NULL;
+    for (int j = 0; tape_backends[j] != NULL; j++) {
+      if (strcmp(tape, tape_backends[j]->name) == 0) {
+        options.tape_ops = tape_backends[j];
+      }
+    }
+  }
+  if (tape == NULL || options.tape_ops != NULL || strcmp(tape, "auto") == 0) {
+    options.deadline_ms = deadline_ms;
+    options.step_budget = step_budget;
+    options.mem_cap = mem_cap_mb * 1024 * 1024;
+    tm = (tm_t *) malloc(sizeof(tm_t));
+    *tm = tm_load_text(&options, (char *) text, size);
+    if (tm->malformed) {
+      tmsim_free(tm);
+      tm = NULL;
+    }
+  }
+  tm_destroy(&options);
+  return tm;
+}
+
+/** Runs a loaded machine on each line of a buffer, stores one answer
+  * character per line and returns the number of lines.
+  */
+long int tmsim_run(const tm_t * machine, const char * inputs, long int size,
+                   char * answers) {
+  tm_t tm = *machine;
+  long int n = 0;
+  int c;
+
+  if (size <= 0) {
+    return 0;
+  }
+  store_init();
+  tm.in = fmemopen((char *) inputs, size, "r");
+  tm.line = NULL;
+  tm.line_cap = 0;
+  tm.inputs = 0;
+  tm.probe = NULL; /* The threads of the walks are the caller's own */
+  while ((c = getc(tm.in)) != EOF) {
+    ungetc(c, tm.in);
+    answers[n++] = tm_run(&tm);
+  }
+  fclose(tm.in);
+  free(tm.line);
+  probe_destroy(tm.probe);
+  store_destroy();
+  return n;
+}
+
+/* Frees a machine loaded by tmsim_load */
+void tmsim_free(tm_t * machine) {
+  if (machine != NULL) {
+    tm_destroy(machine);
+    free(machine);
+  }
+}
+
+/**
+  * AUTOTUNING
+  * Picks the tape backend per machine: the candidates allowed by the
+  * machine's alphabet run the first lines of the run section with the same
+  * step budget, and the fastest one runs everything. The winner is kept in
+  * a cache file, by hash of the loaded machine, so that it is timed once.
+  */
+
+/** Tunes tm->tape_ops. Returns the sample lines it has read from tm->in,
+  * still to be answered, and their length.
+  */
+char * tm_autotune(tm_t * tm, const char * cache, long int * len) {
+  const tape_ops_t *best = NULL, *ops;
+  long int pairs = 0, nondet = 0, transitions = 0, fan_out = 1, n;
+  long int moves[3] = {0, 0, 0}, lines = 0;
+  double times[8], best_ms = 0;
+  char * sample = NULL;
+  size_t sample_cap = 0;
+  uint64_t hash = tm_hash(tm);
+  FILE * f;
+  int c;
+
+  /* 1. Describe the machine */
+  for (int q = 0; q <= tm->max_state; q++) {
+    for (int i = 0; i < tm->states[q].tr_inputs_count; i++) {
+      n = 0;
+      for (tr_output_t * tr = tm->states[q].tr_inputs[i].transitions;
+           tr != NULL; tr = tr->next) {
+        n++;
+        moves[tr->move == 'L' ? 0 : tr->move == 'R' ? 1 : 2]++;
+      }
+      pairs++;
+      transitions += n;
+      nondet += n > 1;
+      fan_out = n > fan_out ? n : fan_out;
+    }
+  }
+  fprintf(stderr, "Autotune: %s, %d symbol IDs, %ld transitions, "
+    "%ld/%ld nondeterministic inputs, fan-out %ld, moves L%ld%% R%ld%% "
+    "S%ld%%\n", nondet > 0 ? "nondeterministic" : "deterministic",
+    tm->alpha.size, transitions, nondet, pairs, fan_out,
+    moves[0] * 100 / (transitions > 0 ? transitions : 1),
+    moves[1] * 100 / (transitions > 0 ? transitions : 1),
+    moves[2] * 100 / (transitions > 0 ? transitions : 1));
+
+  /* 2. Use the winner of a previous run, if any */
+  *len = 0;
+  ops = tune_cache_find(cache, hash);
+  if (ops != NULL) {
+    fprintf(stderr, "Autotune: %s tapes, cached for machine %016llx\n",
+      ops->name, (unsigned long long) hash);
+    tm->tape_ops = ops;
+    return NULL;
+  }
+
+  /* 3. Read the sample */
+  f = open_memstream(&sample, &sample_cap);
+  while (lines < AUTOTUNE_SAMPLE && (c = getc(tm->in)) != EOF) {
+    putc(c, f);
+    lines += c == '\n';
+  }
+  fclose(f);
+  *len = (long int) sample_cap;
+  if (*len > 0 && sample[*len - 1] != '\n') {
+    lines++; /* The last line has no newline */
+  }
+  if (lines == 0) {
+    return sample;
+  }
+
+  /* 4. Time the candidates, the default first */
+  for (int j = 0; tape_backends[j] != NULL; j++) {
+    ops = tape_backends[j];
+    if ((ops == &packed_tape && tm->alpha.bits == 0) ||
+        (ops == &flat_tape && tm->max_steps > FLAT_MAX_STEPS) ||
+        ops == &mapped_tape) {
+      /* Too many IDs to pack the cells, or steps to reserve, and the
+         sample is in memory: mapped tapes would be paged ones */
+      times[j] = -1;
+      continue;
+    }
+    times[j] = tm_time_sample(tm, ops, sample, *len, lines);
+    /* Beating the default takes more than the noise of the timings */
+    if (best == NULL || (times[j] < best_ms && times[j] < times[0] * 0.95)) {
+      best = ops;
+      best_ms = times[j];
+    }
+  }
+  fprintf(stderr, "Autotune:");
+  for (int j = 0; tape_backends[j] != NULL; j++) {
+    if (times[j] >= 0) {
+      fprintf(stderr, " %s %.3fms (%.2fx)", tape_backends[j]->name, times[j],
+        times[j] > 0 ? times[0] / times[j] : 1.0);
+    }
+  }
+  fprintf(stderr, " -> %s tapes\n", best->name);
+
+  /* 5. Remember it */
+  tm->tape_ops = best;
+  f = cache[0] != '\0' ? fopen(cache, "a") : NULL;
+  if (f != NULL) {
+    fprintf(f, "%016llx %s\n", (unsigned long long) hash, best->name);
+    fclose(f);
+  }
+  return sample;
+}
+
+/** Times the sample on a copy of the machine with another tape backend.
+  * Every candidate does the same steps, at most AUTOTUNE_STEPS, and reruns
+  * them for AUTOTUNE_MS at least. Returns the time per run, in milliseconds.
+  */
+double tm_time_sample(tm_t * tm, const tape_ops_t * ops, char * sample,
+                      long int len, long int lines) {
+  struct timespec start, end;
+  tm_t copy = *tm;
+  double ms = 0;
+  long int answers_len, runs = 0;
+
+  copy.tape_ops = ops;
+  copy.quiet = true;
+  copy.deadline_ms = 0;
+  copy.step_budget = AUTOTUNE_STEPS / lines > 0 ? AUTOTUNE_STEPS / lines : 1;
+  if (tm->step_budget > 0 && tm->step_budget < copy.step_budget) {
+    copy.step_budget = tm->step_budget;
+  }
+  copy.line = NULL;
+  copy.line_cap = 0;
+  copy.probe = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    free(tm_answer_text(&copy, sample, len, &answers_len));
+    runs++;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ms = (end.tv_sec - start.tv_sec) * 1e3 +
+         (end.tv_nsec - start.tv_nsec) / 1e6;
+  } while (ms < AUTOTUNE_MS);
+  free(copy.line);
+  probe_destroy(copy.probe);
+  return ms / runs;
+}
+
+/* Hash of the loaded machine: its alphabet, transitions, acceptance and max */
+uint64_t tm_hash(tm_t * tm) {
+  char * text = NULL;
+  size_t size = 0;
+  uint64_t hash;
+  FILE * f = open_memstream(&text, &size);
+
+  fwrite(tm->alpha.code, 1, sizeof(tm->alpha.code), f);
+  fprintf(f, "%d %ld\n", tm->max_state, tm->max_steps);
+  for (int q = 0; q <= tm->max_state; q++) {
+    fprintf(f, "%d %d:", tm->states[q].is_acc, tm->states[q].tr_inputs_count);
+    for (int i = 0; i < tm->states[q].tr_inputs_count; i++) {
+      fprintf(f, " %d", tm->states[q].tr_inputs[i].input);
+      for (tr_output_t * tr = tm->states[q].tr_inputs[i].transitions;
+           tr != NULL; tr = tr->next) {
+        fprintf(f, ",%d %d %c", tr->state, tr->output, tr->move);
+      }
+    }
+    putc('\n', f);
+  }
+  fclose(f);
+  hash = text_hash(text, (long int) size);
+  free(text);
+  return hash;
+}
+
+/* Looks up the backend picked for a machine, NULL if it is not cached */
+const tape_ops_t * tune_cache_find(const char * cache, uint64_t hash) {
+  const tape_ops_t * ops = NULL;
+  unsigned long long h;
+  char name[16];
+  FILE * f = cache[0] != '\0' ? fopen(cache, "r") : NULL;
+
+  if (f == NULL) {
+    return NULL;
+  }
+  while (fscanf(f, "%llx %15s", &h, name) == 2) {
+    if (h == hash) { /* The last entry wins */
+      for (int j = 0; tape_backends[j] != NULL; j++) {
+        if (strcmp(name, tape_backends[j]->name) == 0) {
+          ops = tape_backends[j];
+        }
+      }
+    }
+  }
+  fclose(f);
+  return ops;
+}
+
+/**
+  * STATIC ANALYSIS
+  * Reports on the loaded machine without running it, as text or JSON.
+  * Symbols are printed as one member of their class.
+  */
+
+/* Prints the report of --analyze on tm->out */
+void tm_analyze(tm_t * tm, bool json) {
+  int n = tm->max_state + 1, count = 0, head = 0, tail = 0, fan_out = 0;
+  int *queue = (int *) malloc(n * sizeof(int)), *list;
+  int unreachable = 0, dead = 0, accepting = 0, k;
+  bool *used = (bool *) calloc(n, sizeof(bool));
+  bool *reached = (bool *) calloc(n, sizeof(bool));
+  long int transitions = 0, pairs = 0, nondet = 0, sweeps = 0;
+  double growth = tm_growth(tm);
+  FILE * f = tm->out;
+  tr_output_t * tr;
+  state_t * s;
+  char sym;
+
+  /* 1. States which appear in the machine, and the ones reached from 0 */
+  used[INITIAL_STATE] = reached[INITIAL_STATE] = true;
+  queue[tail++] = INITIAL_STATE;
+  for (int q = 0; q < n; q++) {
+    s = &tm->states[q];
+    used[q] |= s->is_acc || s->tr_inputs_count > 0;
+    for (int i = 0; i < s->tr_inputs_count; i++) {
+      for (tr = s->tr_inputs[i].transitions; tr != NULL; tr = tr->next) {
+        used[tr->state] = true;
+      }
+    }
+  }
+  while (head < tail) {
+    s = &tm->states[queue[head++]];
+    for (int i = 0; i < s->tr_inputs_count; i++) {
+      for (tr = s->tr_inputs[i].transitions; tr != NULL; tr = tr->next) {
+        if (!reached[tr->state]) {
+          reached[tr->state] = true;
+          queue[tail++] = tr->state;
+        }
       }
     }
   }
+  for (int q = 0; q < n; q++) {
+    count += used[q];
+    accepting += used[q] && tm->states[q].is_acc;
+    unreachable += used[q] && !reached[q];
+    dead += used[q] && tm->states[q].acc_dist == LONG_MAX;
+  }
 
-  /** If we got here, computation has finished without reaching
-    * acceptance states.
-    * If we preempted a branch at least once, the machine could have terminated
-    * so the response must be undetermined.
-    */
-  return has_preempted ? SYM_UNDET : SYM_REFUSE;
+  /* 2. Counts */
+  for (int q = 0; q < n; q++) {
+    s = &tm->states[q];
+    for (int i = 0; i < s->tr_inputs_count; i++) {
+      k = 0;
+      for (tr = s->tr_inputs[i].transitions; tr != NULL; tr = tr->next) {
+        k++;
+        sweeps += tr->state == q && tr->move != 'S';
+      }
+      pairs++;
+      transitions += k;
+      nondet += k > 1;
+      fan_out = k > fan_out ? k : fan_out;
+    }
+  }
+  if (json) {
+    fprintf(f, "{\"states\": %d, \"highest_state\": %d, "
+      "\"accepting\": %d, \"transitions_loaded\": %ld, \"transitions\": %ld, "
+      "\"pairs\": %ld, \"nondeterministic_pairs\": %ld, \"max_fan_out\": %d, "
+      "\"symbols\": %d, \"symbol_ids\": %d, \"packed_bits\": %d, "
+      "\"max_steps\": %ld, \"initial_can_accept\": %s, "
+      "\"growth_per_step\": %.4f, \"log10_branches_max_steps\": %.2f",
+      count, tm->max_state, accepting, tm->tr_loaded, transitions, pairs,
+      nondet, fan_out, tm->alpha.used, tm->alpha.size, tm->alpha.bits,
+      tm->max_steps,
+      tm->states[INITIAL_STATE].acc_dist != LONG_MAX ? "true" : "false",
+      growth, log10(growth) * tm->max_steps);
+  } else {
+    fprintf(f, "States: %d (highest %d), %d accepting\n",
+      count, tm->max_state, accepting);
+    fprintf(f, "Transitions: %ld as loaded, %ld after merging symbols, "
+      "on %ld (state, symbol ID) pairs, fan-out up to %d\n",
+      tm->tr_loaded, transitions, pairs, fan_out);
+    fprintf(f, "Alphabet: %d symbols merged into %d IDs, ", tm->alpha.used,
+      tm->alpha.size);
+    fprintf(f, tm->alpha.bits > 0 ? "%d bits per packed cell\n" :
+      "too many to pack\n", tm->alpha.bits);
+    fprintf(f, "Growth: %.3fx branches per step at worst, "
+      "up to 10^%.1f branches in %ld steps\n",
+      growth, log10(growth) * tm->max_steps, tm->max_steps);
+    if (tm->states[INITIAL_STATE].acc_dist == LONG_MAX) {
+      fprintf(f, "The initial state cannot reach acceptance: "
+        "every answer is 0 or U\n");
+    }
+  }
+
+  /* 3. Lists of states */
+  list = queue;
+  k = 0;
+  for (int q = 0; q < n; q++) {
+    if (used[q] && !reached[q]) {
+      list[k++] = q;
+    }
+  }
+  report_list(f, json, "unreachable", list, k);
+  k = 0;
+  for (int q = 0; q < n; q++) {
+    if (used[q] && tm->states[q].acc_dist == LONG_MAX) {
+      list[k++] = q;
+    }
+  }
+  report_list(f, json, "cannot_accept", list, k);
+
+  /* 4. Lists of transitions */
+  for (int pass = 0; pass < 2; pass++) {
+    if (json) {
+      fprintf(f, ", \"%s\": [", pass == 0 ? "nondeterministic" : "sweeps");
+    } else {
+      fprintf(f, "%s: %ld\n", pass == 0 ?
+        "Nondeterministic (state, symbol ID) pairs" :
+        "Self-loop sweeps", pass == 0 ? nondet : sweeps);
+    }
+    k = 0;
+    for (int q = 0; q < n; q++) {
+      s = &tm->states[q];
+      for (int i = 0; i < s->tr_inputs_count; i++) {
+        sym = tm->alpha.sym[(unsigned char) s->tr_inputs[i].input];
+        fan_out = 0;
+        for (tr = s->tr_inputs[i].transitions; tr != NULL; tr = tr->next) {
+          fan_out++;
+        }
+        for (tr = s->tr_inputs[i].transitions; tr != NULL; tr = tr->next) {
+          if (pass == 0 ? tr != s->tr_inputs[i].transitions || fan_out < 2 :
+                          tr->state != q || tr->move == 'S') {
+            continue;
+          }
+          if (json) {
+            fprintf(f, "%s{\"state\": %d, \"symbol\": \"",
+              k > 0 ? ", " : "", q);
+            json_char(f, sym);
+            if (pass == 0) {
+              fprintf(f, "\", \"fan_out\": %d}", fan_out);
+            } else {
+              fprintf(f, "\", \"write\": \"");
+              json_char(f, tm->alpha.sym[(unsigned char) tr->output]);
+              fprintf(f, "\", \"move\": \"%c\"}", tr->move);
+            }
+          } else if (k < ANALYZE_LIST) {
+            fprintf(f, "  state %d on '%c': ", q, sym);
+            if (pass == 0) {
+              fprintf(f, "%d branches\n", fan_out);
+            } else {
+              fprintf(f, "writes '%c', moves %c\n",
+                tm->alpha.sym[(unsigned char) tr->output], tr->move);
+            }
+          } else if (k == ANALYZE_LIST) {
+            fprintf(f, "  ...\n");
+          }
+          k++;
+        }
+      }
+    }
+    if (json) {
+      fprintf(f, "]");
+    }
+  }
+  if (json) {
+    fprintf(f, "}\n");
+  }
+
+  free(queue);
+  free(used);
+  free(reached);
 }
 
-/** Takes in a branch from the queue.
-  * Then executes the given transition, if any.
-  * Looks for the next transition, if it find none it returns the halt state,
-  * else it returns NULL.
-  * Re-enqueues the branch(es) with the next transition(s).
+/** Estimates how fast the branches can multiply at worst, from the state
+  * graph only: G(k, q) branches after k steps from state q, where the
+  * symbol read in each state is the one with the most branches. Returns
+  * the growth per step over ANALYZE_STEPS steps from the initial state.
   */
-state_t * tm_step(tm_t * tm, branch_t * b) {
-  branch_t * b_child;
-  state_t * s = NULL;
-  tr_output_t * tr_next;
-  tr_input_t * tr_in;
-  char input;
+double tm_growth(tm_t * tm) {
+  int n = tm->max_state + 1;
+  double *g = (double *) malloc(n * sizeof(double));
+  double *next = (double *) malloc(n * sizeof(double));
+  double log_scale = 0, top, sum, *swap;
+  tr_output_t * tr;
+  state_t * s;
 
-  /* Execute given transition */
-  if (b->tr != NULL) {
-    LOG("DEBUG: Doing transition -> %d, %c, %c\n",
-      b->tr->state, b->tr->output, b->tr->move);
-    s = &tm->states[b->tr->state]; /* Save next state */
+  for (int q = 0; q < n; q++) {
+    g[q] = 1;
+  }
+  for (int k = 0; k < ANALYZE_STEPS; k++) {
+    top = 0;
+    for (int q = 0; q < n; q++) {
+      s = &tm->states[q];
+      next[q] = 0;
+      for (int i = 0; i < s->tr_inputs_count; i++) {
+        sum = 0;
+        for (tr = s->tr_inputs[i].transitions; tr != NULL; tr = tr->next) {
+          sum += g[tr->state];
+        }
+        next[q] = sum > next[q] ? sum : next[q];
+      }
+      top = next[q] > top ? next[q] : top;
+    }
+    if (top == 0) { /* Every branch halts */
+      g[INITIAL_STATE] = 0;
+      break;
+    }
+    for (int q = 0; q < n; q++) { /* Scale to stay in range */
+      next[q] /= top;
+    }
+    log_scale += log(top);
+    swap = g;
+    g = next;
+    next = swap;
+  }
+  sum = g[INITIAL_STATE] > 0 ?
+        exp((log_scale + log(g[INITIAL_STATE])) / ANALYZE_STEPS) : 0;
+  free(g);
+  free(next);
+  return sum < 1 ? 1 : sum;
+}
 
-    /* Complete the transition */
-    b->state = s;
-    head_write(b, b->tr->output);
-    head_move(b, b->tr->move);
-    b->steps++;
+/* Prints a list of states, up to ANALYZE_LIST of them as text */
+void report_list(FILE * f, bool json, const char * key, int * items,
+                 int count) {
+  if (json) {
+    fprintf(f, ", \"%s\": [", key);
+    for (int i = 0; i < count; i++) {
+      fprintf(f, i > 0 ? ", %d" : "%d", items[i]);
+    }
+    fprintf(f, "]");
+    return;
   }
+  fprintf(f, "%s: %d", strcmp(key, "unreachable") == 0 ?
+    "Unreachable states" : "States that cannot accept", count);
+  for (int i = 0; i < count && i < ANALYZE_LIST; i++) {
+    fprintf(f, i > 0 ? " %d" : " (%d", items[i]);
+  }
+  fprintf(f, count > ANALYZE_LIST ? " ...)\n" : count > 0 ? ")\n" : "\n");
+}
 
-  /* Look for the next transition(s) */
-  s = b->state; /* Save current state */
-  input = head_read(b); /* Read input */
-  tr_in = search_tr_input(s->tr_inputs, 0, s->tr_inputs_count - 1, input);
-  tr_next = tr_in == NULL ? NULL : tr_in->transitions;
+/* Prints a symbol inside a JSON string */
+void json_char(FILE * f, char sym) {
+  unsigned char c = (unsigned char) sym;
+  if (c == '"' || c == '\\') {
+    fprintf(f, "\\%c", c);
+  } else if (c < 0x20 || c >= 0x7f) {
+    fprintf(f, "\\u%04x", c);
+  } else {
+    putc(c, f);
+  }
+}
 
-  if (tr_next == NULL) { /* Machine needs to halt */
-    LOG("DEBUG: Reached halt state\n");
-    return s; /* Returns the halt state */
+/**
+  * SUMMARY
+  * The distribution of the cost of the inputs: their time and steps go in
+  * two log-bucket histograms, cheap enough to fill on every input, and the
+  * slowest ones are kept aside. Printed on stderr at the end of the run.
+  */
+
+/* Creates an empty summary, keeping the given number of slowest inputs */
+summary_t * summary_create(int slowest) {
+  summary_t * sum = (summary_t *) calloc(1, sizeof(summary_t));
+  sum->slowest_cap = slowest;
+  sum->slowest = (slow_input_t *) malloc(slowest * sizeof(slow_input_t));
+  clock_gettime(CLOCK_MONOTONIC, &sum->started);
+  return sum;
+}
+
+/* Destroys a summary */
+void summary_destroy(summary_t * sum) {
+  free(sum->slowest);
+  free(sum);
+}
+
+/* Records the time, the steps and the answer of an input */
+void summary_record(summary_t * sum, long int input, uint64_t ns,
+                    long int steps, char answer) {
+  int i;
+
+  histogram_add(&sum->ns, ns);
+  histogram_add(&sum->steps, (uint64_t) steps);
+  sum->answers[answer == SYM_REFUSE ? 0 : answer == SYM_ACCEPT ? 1 : 2]++;
+
+  /* Insert it among the slowest ones, if it is one of them */
+  if (sum->slowest_count == sum->slowest_cap) {
+    if (sum->slowest_cap == 0 || sum->slowest[sum->slowest_cap - 1].ns >= ns) {
+      return;
+    }
+    sum->slowest_count--; /* The fastest of them leaves */
   }
+  for (i = sum->slowest_count; i > 0 && sum->slowest[i - 1].ns < ns; i--) {
+    sum->slowest[i] = sum->slowest[i - 1];
+  }
+  sum->slowest[i].input = input;
+  sum->slowest[i].ns = ns;
+  sum->slowest[i].steps = steps;
+  sum->slowest[i].answer = answer;
+  sum->slowest_count++;
+}
 
-  /* Set the first transition as the next on this branch */
-  b->tr = tr_next;
-  rq_enqueue(tm, b);
+/* Prints the percentiles, the throughput, the answers and the slowest inputs */
+void summary_print(summary_t * sum, FILE * f) {
+  static const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+  static const char * names[] = {"p50", "p90", "p99", "p99.9"};
+  struct timespec now;
+  double elapsed;
+  long int total = sum->ns.total;
+  char buf[32];
 
-  /** If there are other (non-deterministic) transitions, they are
-    * pushed on top of the first one, so they will be executed first
-    * and copy the memory of their parent at the moment of branching.
-    * In this way we don't waste the parent's memory.
-    */
-  tr_next = tr_next->next;
-  while (tr_next != NULL) {
-    b_child = branch_clone(b, tr_next); /* Clone with shared memory */
-    rq_enqueue(tm, b_child);
-    tr_next = tr_next->next;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = (now.tv_sec - sum->started.tv_sec) +
+            (now.tv_nsec - sum->started.tv_nsec) / 1e9;
+  fprintf(f, "Summary: %ld inputs in %.3fs, %.1f inputs/s\n", total, elapsed,
+    elapsed > 0 ? total / elapsed : 0.0);
+  if (total == 0) {
+    return;
   }
+  fprintf(f, "Summary: answers 0 %ld (%.1f%%), 1 %ld (%.1f%%), "
+    "U %ld (%.1f%%)\n",
+    sum->answers[0], sum->answers[0] * 100.0 / total,
+    sum->answers[1], sum->answers[1] * 100.0 / total,
+    sum->answers[2], sum->answers[2] * 100.0 / total);
 
-  return NULL; /* Next branch in the runqueue will be executed */
+  fprintf(f, "Summary: latency");
+  for (int i = 0; i < 4; i++) {
+    fprintf(f, " %s %s", names[i],
+      format_ns(buf, histogram_percentile(&sum->ns, percentiles[i])));
+  }
+  fprintf(f, " max %s\n", format_ns(buf, sum->ns.max));
+  fprintf(f, "Summary: steps");
+  for (int i = 0; i < 4; i++) {
+    fprintf(f, " %s %llu", names[i], (unsigned long long)
+      histogram_percentile(&sum->steps, percentiles[i]));
+  }
+  fprintf(f, " max %llu\n", (unsigned long long) sum->steps.max);
+
+  fprintf(f, "Summary: slowest inputs");
+  for (int i = 0; i < sum->slowest_count; i++) {
+    fprintf(f, "%s %ld (%s, %ld steps, %c)", i > 0 ? "," : "",
+      sum->slowest[i].input, format_ns(buf, sum->slowest[i].ns),
+      sum->slowest[i].steps, sum->slowest[i].answer);
+  }
+  fprintf(f, "\n");
 }
 
-/** Read the char in the cell under head, even if no page is allocated.
-  * NOTE: Assuming that if the head is set, it is in a valid position
+/* Counts a value in its bucket */
+void histogram_add(histogram_t * h, uint64_t v) {
+  h->counts[histogram_bucket(v)]++;
+  h->total++;
+  if (v > h->max) {
+    h->max = v;
+  }
+}
+
+/** Returns the bucket of a value: the power of two, then the top
+  * HIST_SUB_BITS bits after the leading one.
   */
-char head_read(branch_t * b) {
-  /* First check if any page is allocated */
-  if (b->head_page == NULL) {
-    return BLANK; /* Do not waste time+space allocating memory */
-  } else {
-    return b->head_page->mem[b->head_pos];
+int histogram_bucket(uint64_t v) {
+  int e;
+  if (v < (1 << HIST_SUB_BITS)) {
+    return (int) v;
   }
+  e = 63 - __builtin_clzll(v); /* Position of the leading one */
+  return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+         (int) ((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
 }
 
-/** Write given char in the cell under the head.
-  * also handles page fault if there is no page allocated
-  * and makes the tape private if needed (copy-on-write)
+/* Returns the highest value falling in a bucket */
+uint64_t histogram_highest(int bucket) {
+  int e, shift;
+  if (bucket < (1 << HIST_SUB_BITS)) {
+    return (uint64_t) bucket;
+  }
+  e = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  shift = e - HIST_SUB_BITS;
+  return ((((uint64_t) 1 << HIST_SUB_BITS) +
+           (bucket & ((1 << HIST_SUB_BITS) - 1))) << shift) +
+         (((uint64_t) 1 << shift) - 1);
+}
+
+/** Returns the value below which a fraction p of the values fall,
+  * rounded up to the end of its bucket, but no more than the maximum.
   */
-void head_write(branch_t * b, char c) {
-  /* First check if any page is allocated */
-  if (b->head_page == NULL && c != BLANK) {
-    LOG("DEBUG: Page fault, creating first page\n");
-    /* If there is no page and we're not writing a blank, create the first one */
-    b->head_page = page_create(NULL, NULL, NULL);
-    b->tape->first_page = b->head_page;
+uint64_t histogram_percentile(histogram_t * h, double p) {
+  long int rank = (long int) ceil(p * h->total), seen = 0;
+  uint64_t v;
+
+  if (rank < 1) {
+    rank = 1;
   }
-  if (b->head_page->mem[b->head_pos] != c) { /* Only write if different */
-    if (b->tape->ref_count > 1) { /* If the tape is shared, make it private */
-      tape_make_private(b);
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      v = histogram_highest(i);
+      return v < h->max ? v : h->max;
     }
-    /* Now write the char */
-    b->head_page->mem[b->head_pos] = c;
   }
+  return h->max;
 }
 
-/* Move the head L, S, R and handle page fault */
-void head_move(branch_t * b, char move) {
-  if (b->head_page == NULL || move == 'S') { /* If there is no page allocated, just do nothing */
-    return;
+/* Formats nanoseconds with a readable unit, buf must hold 32 chars */
+const char * format_ns(char * buf, uint64_t ns) {
+  if (ns < 1000) {
+    snprintf(buf, 32, "%lluns", (unsigned long long) ns);
+  } else if (ns < 1000000) {
+    snprintf(buf, 32, "%.1fus", ns / 1e3);
+  } else if (ns < 1000000000) {
+    snprintf(buf, 32, "%.1fms", ns / 1e6);
   } else {
-    if (move == 'R') {
-      if (b->head_page->next == NULL && b->head_pos == PAGE_SIZE - 1) { /* Right page fault */
-        /* Create the new page an mark it private */
-        b->head_page->next = page_create(b->head_page, NULL, NULL);
+    snprintf(buf, 32, "%.2fs", ns / 1e9);
+  }
+  return buf;
+}
+
+/**
+  * AUTOMATA
+  * A machine whose transitions all move right never reads a cell it wrote:
+  * after t steps every branch is on cell t, reading the input or a blank.
+  * The branches are then just a set of states, a bitset stepped with one
+  * table lookup per byte of the set. Past the input the cells are all
+  * blank, so the sets eventually repeat: once a cycle is found (as Brent
+  * does) the set at max steps is found from it, without running there.
+  */
+
+/** Builds the automaton of a machine whose transitions all move right,
+  * returns NULL if some doesn't or if the tables would be too large.
+  */
+nfa_t * nfa_create(tm_t * tm) {
+  int states = tm->max_state + 1, ids = tm->alpha.size, words, groups;
+  long int size;
+  nfa_t * a;
+  tr_input_t * tr_in;
+  uint64_t * succ, * row;
+  int low;
+
+  for (int q = 0; q <= tm->max_state; q++) {
+    for (int k = 0; k < tm->states[q].tr_inputs_count; k++) {
+      for (tr_output_t * tr = tm->states[q].tr_inputs[k].transitions;
+           tr != NULL; tr = tr->next) {
+        if (tr->move != 'R') {
+          return NULL;
+        }
       }
-      if (b->head_pos == PAGE_SIZE - 1) { /* Move to next page */
-        b->head_page = b->head_page->next;
-        b->head_pos = 0;
-      } else { /* Just increment the position */
-        b->head_pos++;
+    }
+  }
+  words = (states + 63) / 64;
+  groups = (states + 7) / 8;
+  size = (long int) ids * groups * 256 * words * sizeof(uint64_t);
+  if (size > NFA_MAX_TABLE) {
+    return NULL;
+  }
+
+  a = (nfa_t *) malloc(sizeof(nfa_t));
+  a->words = words;
+  a->groups = groups;
+  a->table = (uint64_t *) calloc(size / sizeof(uint64_t), sizeof(uint64_t));
+  a->live = (uint64_t *) calloc((long int) ids * words, sizeof(uint64_t));
+  a->final = (uint64_t *) calloc(words, sizeof(uint64_t));
+  succ = (uint64_t *) malloc((long int) states * words * sizeof(uint64_t));
+  for (int q = 0; q < states; q++) {
+    if (tm->states[q].is_acc && tm->states[q].tr_inputs_count == 0) {
+      a->final[q / 64] |= (uint64_t) 1 << (q % 64);
+    }
+  }
+
+  for (int id = 0; id < ids; id++) {
+    /* 1. Successors of each state on this ID */
+    memset(succ, 0, (long int) states * words * sizeof(uint64_t));
+    for (int q = 0; q < states; q++) {
+      tr_in = tm_find_tr_input(tm, &tm->states[q], (char) id);
+      if (tr_in == NULL || tr_in->transitions == NULL) {
+        continue;
       }
-    } else if (move == 'L') {
-      if (b->head_page->prev == NULL && b->head_pos == 0) { /* Left page fault */
-        /* Create the new page */
-        b->head_page->prev = page_create(NULL, b->head_page, NULL);
-        b->tape->first_page = b->head_page->prev;
+      a->live[(long int) id * words + q / 64] |= (uint64_t) 1 << (q % 64);
+      for (tr_output_t * tr = tr_in->transitions; tr != NULL; tr = tr->next) {
+        succ[(long int) q * words + tr->state / 64] |=
+          (uint64_t) 1 << (tr->state % 64);
       }
-      if (b->head_pos == 0) { /* Move to previous page */
-        b->head_page = b->head_page->prev;
-        b->head_pos = PAGE_SIZE - 1;
-      } else { /* Just decrement the position */
-        b->head_pos--;
+    }
+    /* 2. Union of the successors for each value of each byte of a set */
+    for (int g = 0; g < groups; g++) {
+      row = &a->table[((long int) id * groups + g) * 256 * words];
+      for (int v = 1; v < 256; v++) {
+        low = __builtin_ctz(v);
+        if (g * 8 + low >= states) {
+          continue; /* No such state, its bit is never set */
+        }
+        for (int w = 0; w < words; w++) {
+          row[v * words + w] = row[(v & (v - 1)) * words + w] |
+                               succ[(long int) (g * 8 + low) * words + w];
+        }
       }
     }
   }
+  free(succ);
+  LOG("INFO: Only moving right, run as an automaton of %d states\n", states);
+  return a;
 }
 
-/* Inserts a branch at the end of the runqueue */
-void rq_enqueue(tm_t * tm, branch_t * b) {
-  b->next = NULL;
-  if (tm->rq_tail != NULL) { /* The queue is non-empty */
-    tm->rq_tail->next = b;
-    tm->rq_tail = b;
-  } else { /* The queue is empty */
-    tm->rq_head = b;
-    tm->rq_tail = b;
+/* Destroys an automaton, if any */
+void nfa_destroy(nfa_t * a) {
+  if (a != NULL) {
+    free(a->table);
+    free(a->live);
+    free(a->final);
+    free(a);
   }
 }
 
-/* Removes a branch from the head of the runqueue and returns it */
-branch_t * rq_dequeue(tm_t * tm) {
-  branch_t * b;
-  if (tm->rq_head != NULL) {
-    b = tm->rq_head;
-    tm->rq_head = b->next;
-    if(tm->rq_head == NULL) {
-      tm->rq_tail = NULL;
+/** Runs the input in tm->line on the automaton, with the answer that the
+  * runqueue would give: accepting if some branch halts in a final state
+  * within max steps, undetermined if some branch still has a transition
+  * at max steps, refused otherwise.
+  * Each step of the set counts as one, against the step budget, and the
+  * limits are checked as the runqueue does.
+  */
+char nfa_run(tm_t * tm, long int len) {
+  nfa_t * a = tm->nfa;
+  int words = a->words, id;
+  uint64_t * sets, * cur, * next, * mark, * swap, any;
+  long int t = 0, mark_t = -1, power = 1, end, chunk, n;
+  bool preempted = false, repeated;
+  char c = SYM_REFUSE;
+
+  if (tm->max_steps == 0) { /* The root is preempted at once */
+    return SYM_UNDET;
+  }
+  sets = (uint64_t *) calloc(3 * words, sizeof(uint64_t));
+  cur = sets;
+  next = cur + words;
+  mark = next + words;
+  cur[INITIAL_STATE / 64] = (uint64_t) 1 << (INITIAL_STATE % 64);
+
+  if (words == 1) { /* Up to 64 states: run the input in a tight loop */
+    end = len < tm->max_steps ? len : tm->max_steps;
+    while (t < end) {
+      chunk = end - t < LIMIT_PERIOD ? end - t : LIMIT_PERIOD;
+      n = nfa_run_word(a, tm->line + t, chunk, cur, &tm->work);
+      t += n;
+      if (n < chunk) { /* Accepted or halted, the loop below tells */
+        break;
+      }
+      if (tm->work > tm->next_check && tm_check_limits(tm, t)) {
+        free(sets);
+        return SYM_UNDET;
+      }
     }
-    return b;
-  } else {
-    return NULL;
   }
+  while (true) {
+    /* 1. Branches halting in a final state accept */
+    any = 0;
+    for (int w = 0; w < words; w++) {
+      any |= cur[w] & a->final[w];
+    }
+    if (any != 0) {
+      c = SYM_ACCEPT;
+      break;
+    }
+    id = t < len ? (unsigned char) tm->line[t] : BLANK_ID;
+    if (t == tm->max_steps) { /* The others are preempted, if they can go on */
+      for (int w = 0; w < words; w++) {
+        any |= cur[w] & a->live[(long int) id * words + w];
+      }
+      preempted = any != 0;
+      break;
+    }
+
+    /* 2. Step all of them */
+    if (tm->work > tm->next_check && tm_check_limits(tm, t)) {
+      c = SYM_UNDET; /* Out of time or steps */
+      break;
+    }
+    tm->work++;
+    nfa_step(a, cur, id, next);
+    swap = cur;
+    cur = next;
+    next = swap;
+    t++;
+    any = 0;
+    for (int w = 0; w < words; w++) {
+      any |= cur[w];
+    }
+    if (any == 0) { /* All halted */
+      break;
+    }
+
+    /* 3. Past the input, look for a set already seen */
+    if (t >= len) {
+      repeated = mark_t >= 0;
+      for (int w = 0; w < words && repeated; w++) {
+        repeated = cur[w] == mark[w];
+      }
+      if (repeated) {
+        /* Nothing new happens after t: skip whole cycles up to max steps */
+        for (long int k = (tm->max_steps - t) % (t - mark_t); k > 0; k--) {
+          nfa_step(a, cur, BLANK_ID, next);
+          swap = cur;
+          cur = next;
+          next = swap;
+        }
+        any = 0;
+        for (int w = 0; w < words; w++) {
+          any |= cur[w] & a->live[(long int) BLANK_ID * words + w];
+        }
+        preempted = any != 0;
+        break;
+      }
+      if (mark_t < 0 || t - mark_t == power) { /* Move the mark ahead */
+        power = mark_t < 0 ? 1 : power * 2;
+        memcpy(mark, cur, words * sizeof(uint64_t));
+        mark_t = t;
+      }
+    }
+  }
+  free(sets);
+  return c != SYM_REFUSE ? c : preempted ? SYM_UNDET : SYM_REFUSE;
+}
+
+/** Steps a set of up to 64 states over the given cells, stopping early
+  * if it accepts or empties, and adds them to work.
+  * Returns the cells stepped over.
+  */
+long int nfa_run_word(nfa_t * a, const char * cells, long int count,
+                      uint64_t * set, long int * work) {
+  const uint64_t * table = a->table;
+  uint64_t cur = *set, next, final = a->final[0];
+  int groups = a->groups;
+  const uint64_t * row;
+  long int t;
+
+  for (t = 0; t < count && cur != 0 && (cur & final) == 0; t++) {
+    row = &table[(long int) (unsigned char) cells[t] * groups * 256];
+    next = row[cur & 0xFF];
+    for (int g = 1; g < groups && (cur >> (g * 8)) != 0; g++) {
+      next |= row[g * 256 + ((cur >> (g * 8)) & 0xFF)];
+    }
+    cur = next;
+  }
+  *set = cur;
+  *work += t;
+  return t;
+}
+
+/* Computes the successors of a set of states reading the given ID */
+void nfa_step(nfa_t * a, const uint64_t * from, int id, uint64_t * to) {
+  int words = a->words, v;
+  const uint64_t * row = &a->table[(long int) id * a->groups * 256 * words];
+
+  memset(to, 0, words * sizeof(uint64_t));
+  for (int g = 0; g < a->groups; g++, row += 256 * words) {
+    v = (int) ((from[g / 8] >> (g % 8 * 8)) & 0xFF);
+    if (v != 0) {
+      for (int w = 0; w < words; w++) {
+        to[w] |= row[v * words + w];
+      }
+    }
+  }
+}
+
+/**
+  * PROBE
+  * Before the exact run, random walks go down the computation tree: each
+  * one follows a single branch on its own mutable tape, picking one of the
+  * transitions at random at every fork, so nothing is cloned or queued.
+  * An accepting walk answers 1, otherwise the exact run decides.
+  * The walks of an input are seeded by the seed, the input and their index,
+  * so the same seed repeats them whatever the threads running them.
+  */
+
+/** Runs up to tm->probe_walks random walks on the input in tm->line,
+  * over tm->probe_threads threads, the caller being one of them. Their
+  * steps count as the input's, against its deadline and step budget.
+  * Returns 1 if one of them accepts, U if they reach a limit, 0 if the
+  * exact run has to decide.
+  */
+char tm_probe(tm_t * tm, long int len) {
+  probe_t * p = tm->probe;
+  int count = tm->probe_threads;
+
+  if (p == NULL) { /* First input, start the threads */
+    if (count > tm->probe_walks) {
+      count = (int) tm->probe_walks;
+    }
+    p = tm->probe = probe_create(count > 1 ? count - 1 : 0);
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->tm = tm;
+  p->len = len;
+  p->seed = rng_mix(tm->probe_seed ^ rng_mix((uint64_t) tm->inputs));
+  p->next_walk = 0;
+  p->steps = 0;
+  p->accepted = false;
+  p->limit = NULL;
+  p->input++;
+  p->running = p->thread_count;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+
+  probe_run(p);
+  pthread_mutex_lock(&p->lock);
+  while (p->running > 0) {
+    pthread_cond_wait(&p->done, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  tm->work = p->steps;
+  tm->next_check = tm->work; /* The exact run checks at its first step */
+  tm->limit = p->accepted ? NULL : p->limit;
+  return p->accepted ? SYM_ACCEPT : p->limit != NULL ? SYM_UNDET : SYM_REFUSE;
+}
+
+/* Starts the threads of the walks, waiting for an input */
+probe_t * probe_create(int thread_count) {
+  probe_t * p = (probe_t *) calloc(1, sizeof(probe_t));
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start, NULL);
+  pthread_cond_init(&p->done, NULL);
+  p->thread_count = thread_count;
+  p->threads = (pthread_t *) malloc((thread_count + 1) * sizeof(pthread_t));
+  for (int i = 0; i < thread_count; i++) {
+    pthread_create(&p->threads[i], NULL, probe_worker, p);
+  }
+  return p;
+}
+
+/* Stops the threads of the walks and deallocates them, p may be NULL */
+void probe_destroy(probe_t * p) {
+  if (p == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&p->lock);
+  p->quit = true;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+  for (int i = 0; i < p->thread_count; i++) {
+    pthread_join(p->threads[i], NULL);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->start);
+  pthread_cond_destroy(&p->done);
+  free(p->threads);
+  free(p);
+}
+
+/* Probe thread, with its own page store: walks each input in turn */
+void * probe_worker(void * arg) {
+  probe_t * p = (probe_t *) arg;
+  long int input = 0;
+
+  store_init();
+  pthread_mutex_lock(&p->lock);
+  while (true) {
+    while (p->input == input && !p->quit) {
+      pthread_cond_wait(&p->start, &p->lock);
+    }
+    if (p->quit) {
+      break;
+    }
+    input = p->input;
+    pthread_mutex_unlock(&p->lock);
+    probe_run(p);
+    pthread_mutex_lock(&p->lock);
+    if (--p->running == 0) {
+      pthread_cond_signal(&p->done);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  store_destroy();
+  return NULL;
+}
+
+/* Takes walks until there are none left, one accepts or a limit is hit */
+void probe_run(probe_t * p) {
+  tm_t * tm = p->tm;
+  long int walk;
+  bool accepted;
+
+  while (true) {
+    pthread_mutex_lock(&p->lock);
+    walk = p->accepted || p->limit != NULL ||
+           p->next_walk == tm->probe_walks ? -1 : p->next_walk++;
+    pthread_mutex_unlock(&p->lock);
+    if (walk < 0) {
+      break;
+    }
+    accepted = probe_walk(p,
+      rng_mix(p->seed + (uint64_t) walk * 0x9E3779B97F4A7C15ULL));
+    if (accepted) {
+      pthread_mutex_lock(&p->lock);
+      p->accepted = true;
+      pthread_mutex_unlock(&p->lock);
+    }
+  }
+}
+
+/** Runs one random walk from the initial configuration, seeded by rng.
+  * It stops as the exact run would stop its branch: halting, or preempted
+  * after tm->max_steps steps; or when the walks are over.
+  * Returns true if it halts accepting.
+  */
+bool probe_walk(probe_t * p, uint64_t rng) {
+  tm_t * tm = p->tm;
+  branch_t * b = branch_create(tm, tm->line, 0, p->len);
+  tr_input_t * tr_in;
+  tr_output_t * tr;
+  bool accepted = false;
+  long int charged = 0;
+  int n;
+
+  /* The exact run preempts the root at once if no step is allowed */
+  while (tm->max_steps > 0) {
+    tr_in = tm_find_tr_input(tm, b->state, head_read(b));
+    tr = tr_in == NULL ? NULL : tr_in->transitions;
+    if (tr == NULL) { /* Halted */
+      accepted = b->state->tr_inputs_count == 0 && b->state->is_acc;
+      break;
+    }
+    if (b->steps == tm->max_steps) { /* Preempted */
+      break;
+    }
+    if (b->steps - charged == LIMIT_PERIOD) {
+      charged = b->steps;
+      if (probe_charge(p, LIMIT_PERIOD)) {
+        break;
+      }
+    }
+
+    /* Pick one of the transitions */
+    n = 0;
+    for (tr_output_t * t = tr; t != NULL; t = t->next) {
+      n++;
+    }
+    for (n = (int) (rng_next(&rng) % n); n > 0; n--) {
+      tr = tr->next;
+    }
+    b->state = &tm->states[tr->state];
+    head_write(b, tr->output);
+    head_move(b, tr->move);
+    b->steps++;
+  }
+  probe_charge(p, b->steps - charged);
+  branch_destroy(b);
+  return accepted;
+}
+
+/** Adds steps to the ones of the walks, and checks the deadline and the
+  * step budget of the input. Returns true if the walks are over: a limit
+  * was reached, or some walk has accepted.
+  */
+bool probe_charge(probe_t * p, long int steps) {
+  tm_t * tm = p->tm;
+  struct timespec now;
+  const char * limit = NULL;
+  bool over;
+
+  if (tm->deadline_ms > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - tm->started.tv_sec) * 1000 +
+        (now.tv_nsec - tm->started.tv_nsec) / 1000000 >= tm->deadline_ms) {
+      limit = "deadline";
+    }
+  }
+  pthread_mutex_lock(&p->lock);
+  p->steps += steps;
+  if (tm->step_budget > 0 && p->steps > tm->step_budget) {
+    limit = "step budget";
+  }
+  if (limit != NULL && p->limit == NULL) {
+    p->limit = limit;
+  }
+  over = p->accepted || p->limit != NULL;
+  pthread_mutex_unlock(&p->lock);
+  return over;
+}
+
+/* Returns the next number of a xorshift64* generator */
+uint64_t rng_next(uint64_t * rng) {
+  *rng ^= *rng >> 12;
+  *rng ^= *rng << 25;
+  *rng ^= *rng >> 27;
+  return *rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* Scrambles a number into a seed, as splitmix64 does; never returns 0 */
+uint64_t rng_mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+  return x != 0 ? x : 1;
 }
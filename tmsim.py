@@ -0,0 +1,141 @@
+"""Python bindings of tm-sim, running machines in process through
+libtmsim.so (build it with `make libtmsim.so`). Standard library only.
+
+    import tmsim
+    m = tmsim.Machine(open("machine.txt").read())
+    m.run(["aab", "abb"])     # b"10", one answer per string
+    m.run(b"aab\\nabb\\n")      # the same, from a buffer of lines
+
+The description holds the "tr", "acc" and "max" sections, anything after
+them (such as a "run" section) is ignored. A machine is loaded once and
+can be run by several threads at once: the GIL is released while the
+strings run.
+
+Run as a script, it compares its throughput with spawning tm-sim:
+
+    python3 tmsim.py INPUT_FILE [BATCHES]
+"""
+
+import ctypes
+import os
+import subprocess
+import sys
+import time
+
+_HERE = os.path.dirname(os.path.abspath(__file__))
+_lib = None
+
+TAPES = ("auto", "paged", "packed", "rle", "flat", "mapped")
+
+
+def _library():
+    """Loads libtmsim.so, from $TMSIM_LIBRARY or next to this file."""
+    global _lib
+    if _lib is None:
+        path = os.environ.get("TMSIM_LIBRARY",
+                              os.path.join(_HERE, "libtmsim.so"))
+        lib = ctypes.CDLL(path)  # CDLL releases the GIL during calls
+        lib.tmsim_load.restype = ctypes.c_void_p
+        lib.tmsim_load.argtypes = [ctypes.c_char_p, ctypes.c_long,
+                                   ctypes.c_char_p, ctypes.c_long,
+                                   ctypes.c_long, ctypes.c_long]
+        lib.tmsim_run.restype = ctypes.c_long
+        lib.tmsim_run.argtypes = [ctypes.c_void_p, ctypes.c_char_p,
+                                  ctypes.c_long, ctypes.c_char_p]
+        lib.tmsim_free.restype = None
+        lib.tmsim_free.argtypes = [ctypes.c_void_p]
+        _lib = lib
+    return _lib
+
+
+class Machine:
+    """A loaded machine. The options are the ones of the command line:
+    tape is "auto", "paged", "packed", "rle", "flat" or "mapped" (None for
+    the default), and 0 means no deadline, budget or memory cap. Raises
+    ValueError for an unknown tape or a malformed description."""
+
+    def __init__(self, description, tape=None, deadline_ms=0, budget=0,
+                 mem_cap_mb=0):
+        if tape is not None and tape not in TAPES:
+            raise ValueError("unknown tape backend: %s" % tape)
+        if isinstance(description, str):
+            description = description.encode()
+        self._lib = _library()
+        self._handle = self._lib.tmsim_load(
+            description, len(description),
+            tape.encode() if tape is not None else None,
+            deadline_ms, budget, mem_cap_mb)
+        if not self._handle:
+            raise ValueError("malformed machine: the \"tr\", \"acc\" and "
+                             "\"max\" sections are expected")
+
+    def run(self, inputs):
+        """Runs the machine on a list of strings, or on a buffer with one
+        string per line. Returns the answers as bytes, one per string:
+        b"1" accept, b"0" refuse, b"U" undetermined."""
+        if self._handle is None:
+            raise ValueError("machine is closed")
+        if isinstance(inputs, (bytes, bytearray, memoryview)):
+            buf = bytes(inputs)
+        else:
+            buf = b"".join((s.encode() if isinstance(s, str) else bytes(s))
+                           + b"\n" for s in inputs)
+        answers = ctypes.create_string_buffer(buf.count(b"\n") + 1)
+        n = self._lib.tmsim_run(self._handle, buf, len(buf), answers)
+        return answers.raw[:n]
+
+    def close(self):
+        if self._handle is not None:
+            self._lib.tmsim_free(self._handle)
+            self._handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def __del__(self):
+        if getattr(self, "_handle", None) is not None:
+            self.close()
+
+
+def _bench(path, batches):
+    """Runs the strings of an input file in batches, once by spawning
+    tm-sim per batch and once in process, and prints both timings."""
+    with open(path, "rb") as f:
+        text = f.read()
+    head, sep, tail = text.partition(b"\nrun\n")
+    if not sep:
+        sys.exit("%s has no run section" % path)
+    description = head + b"\n"
+    lines = tail.splitlines()
+    size = max(1, len(lines) // batches)
+    chunks = [lines[i:i + size] for i in range(0, len(lines), size)]
+    binary = os.path.join(_HERE, "tm-sim")
+
+    start = time.perf_counter()
+    spawned = b""
+    for chunk in chunks:
+        stdin = description + b"run\n" + b"".join(s + b"\n" for s in chunk)
+        out = subprocess.run([binary], input=stdin, stdout=subprocess.PIPE,
+                             check=True).stdout
+        spawned += out.replace(b"\n", b"")
+    spawn_time = time.perf_counter() - start
+
+    start = time.perf_counter()
+    with Machine(description) as m:
+        loaded = b"".join(m.run(chunk) for chunk in chunks)
+    lib_time = time.perf_counter() - start
+
+    print("%d strings in %d batches" % (len(lines), len(chunks)))
+    print("subprocess: %.3fs" % spawn_time)
+    print("in process: %.3fs (%.1fx)" % (lib_time, spawn_time / lib_time))
+    if spawned != loaded:
+        sys.exit("the answers differ")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        sys.exit("usage: %s INPUT_FILE [BATCHES]" % sys.argv[0])
+    _bench(sys.argv[1], int(sys.argv[2]) if len(sys.argv) > 2 else 100)